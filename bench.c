@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <time.h>
+#include <assert.h>
+#include <stddef.h>
+#include "tavl.h"
+#include "rtavl.h"
+
+//-----------------------------------------------------------
+// Macros
+//-----------------------------------------------------------
+#define BENCH_SEED      (12345)
+#define BENCH_LOOP      (1000000)
+// Lookup benchmark - 2^20 segments, one every 64 LBAs, 2^16 buckets of 1024 LBAs.
+#define LOOKUP_SEGMENTS (1 << 20)
+#define LOOKUP_STRIDE   (64)
+#define LOOKUP_SHIFT    (10)
+#define LOOKUP_BUCKETS  (LOOKUP_SEGMENTS * LOOKUP_STRIDE >> LOOKUP_SHIFT)
+// Scan benchmark - full scans of the same segments, taken 64 at a time by the cursor
+#define LOOKUP_BATCH    (64)
+#define SCAN_PASSES     (10)
+
+//-----------------------------------------------------------
+// Structure definitions
+//-----------------------------------------------------------
+typedef struct benchResult {
+    double          seconds;
+    unsigned long   inserts;
+    unsigned long   removes;
+    unsigned long   insertRotations;
+    unsigned long   removeRotations;
+    unsigned long   maxRemoveRotations;
+    unsigned        rootHeight;
+} benchResult_t;
+
+//-----------------------------------------------------------
+// Global variables
+//-----------------------------------------------------------
+static benchResult_t    result;
+
+//-----------------------------------------------------------
+// Functions
+//-----------------------------------------------------------
+/**
+ *  @brief  Removes a segment from the tree, counting rotations
+ *  @param  segment_t *x - segment to be removed
+ *  @return None
+ */
+static void benchFree(segment_t *x) {
+    unsigned long before = tavlRotations;
+    unsigned long rotations;
+
+    freeNode(x);
+    rotations = tavlRotations - before;
+    result.removes++;
+    result.removeRotations += rotations;
+    result.maxRemoveRotations = MAX(result.maxRemoveRotations, rotations);
+}
+
+/**
+ *  @brief  Inserts a segment with coherency management, counting rotations
+ *  @param  segment_t *tSeg - segment with key and number of blocks set
+ *  @return None
+ */
+static void benchInsert(segment_t *tSeg) {
+    tavl_node_t *cNode, *higherNode;
+    unsigned long before;
+
+    cNode=searchTavl(cacheMgmt.tavl.root, tSeg->key);
+    if ((NULL!=cNode) && (&cacheMgmt.tavl.lowest!=cNode)) {
+        if ((cNode->pSeg->key+cNode->pSeg->numberOfBlocks)>tSeg->key) {
+            benchFree(cNode->pSeg);
+        }
+    }
+    before = tavlRotations;
+    cacheMgmt.tavl.root = insertToTavl(&cacheMgmt.tavl, (tavl_node_t *)(tSeg->pNode));
+    result.insertRotations += tavlRotations - before;
+    result.inserts++;
+    pushToTail(tSeg, &cacheMgmt.lru);
+    higherNode=((tavl_node_t *)(tSeg->pNode))->higher;
+    while (&cacheMgmt.tavl.highest!=higherNode) {
+        if (higherNode->pSeg->key>=(tSeg->key+tSeg->numberOfBlocks)) {
+            break;
+        }
+        benchFree(higherNode->pSeg);
+        higherNode=((tavl_node_t *)(tSeg->pNode))->higher;
+    }
+}
+
+/**
+ *  @brief  Runs the random delete and add loop of main.c without the log output
+ *  @param  unsigned numOfSegments - size of the cache
+ *          unsigned lbaSpace - LBAs are picked from [0..lbaSpace)
+ *          unsigned loops - number of segments to add
+ *          bool rankBalanced - WAVL if true, AVL otherwise
+ *  @return None
+ */
+static void benchChurn(unsigned numOfSegments, unsigned lbaSpace, unsigned loops, bool rankBalanced) {
+    segment_t *tSeg;
+    tavl_node_t *cNode;
+    clock_t start;
+    unsigned i;
+
+    srand(BENCH_SEED);
+    initCache(numOfSegments);
+    setRankBalanced(&cacheMgmt.tavl, rankBalanced);
+    result = (benchResult_t){0};
+
+    start = clock();
+    for (i = 0; i < loops; i++) {
+        // Remove a random node, but only if there is none left in the free pool.
+        while (NULL==(tSeg=popFromHead(&cacheMgmt.free))) {
+            do {
+                cNode=searchTavl(cacheMgmt.tavl.root, rand() % lbaSpace);
+            } while (NULL==cNode);
+            if (&cacheMgmt.tavl.lowest==cNode) {
+                cNode=cNode->higher;
+            }
+            benchFree(cNode->pSeg);
+        }
+        initSegment(tSeg);
+        initNode(tSeg->pNode);
+        tSeg->key = rand() % lbaSpace;
+        tSeg->numberOfBlocks = 10+(rand()%20);
+        benchInsert(tSeg);
+    }
+    result.seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    result.rootHeight = avlHeight(cacheMgmt.tavl.root);
+
+    if (rankBalanced) {
+        assert(wavlRankCheck(cacheMgmt.tavl.root));
+    } else {
+        assert(tavlHeightCheck(cacheMgmt.tavl.root));
+    }
+
+    // Empty the cache and give the pool back.
+    while (&cacheMgmt.lru.tail!=cacheMgmt.lru.head.next) {
+        freeNode(cacheMgmt.lru.head.next);
+    }
+    shrinkCache(cacheMgmt.chunks);
+    assert(drainChunk(cacheMgmt.chunks, UINT_MAX));
+
+    printf("%-5s segments:%-8d loops:%-8d %8.0f ops/s  rotations/insert:%.3f  rotations/remove:%.3f  max rotations/remove:%lu  height:%d\n",
+        rankBalanced ? "WAVL" : "AVL", numOfSegments, loops,
+        (result.inserts + result.removes) / (result.seconds > 0 ? result.seconds : 1e-9),
+        (double)result.insertRotations / (result.inserts ? result.inserts : 1),
+        (double)result.removeRotations / (result.removes ? result.removes : 1),
+        result.maxRemoveRotations, result.rootHeight);
+}
+
+/**
+ *  @brief  Returns the key found by a lookup, or UINT_MAX for the lowest sentinel
+ *  @param  tavl_node_t *pNode - result of a lookup, tavl_t *pTavl - the tree searched
+ *  @return unsigned key
+ */
+static unsigned lookupKey(tavl_node_t *pNode, tavl_t *pTavl) {
+    return (&pTavl->lowest == pNode) ? UINT_MAX : pNode->pSeg->key;
+}
+
+/**
+ *  @brief  Shuffles the given array of segments
+ *  @param  segment_t **segs - the array, unsigned numOfSegments - its size
+ *  @return None
+ */
+static void shuffleSegments(segment_t **segs, unsigned numOfSegments) {
+    segment_t *tSeg;
+    unsigned i, j;
+
+    for (i = numOfSegments - 1; 0 < i; i--) {
+        j = rand() % (i + 1);
+        tSeg = segs[i];
+        segs[i] = segs[j];
+        segs[j] = tSeg;
+    }
+}
+
+/**
+ *  @brief  Compares full scans of the Thread of the cache, one node at a time against the cursor
+ *  @param  None
+ *  @return None
+ */
+static void benchScan(void) {
+    tavlScanEntry_t entries[LOOKUP_BATCH];
+    tavlCursor_t cursor;
+    tavl_node_t *pNode;
+    unsigned long walkSum = 0, cursorSum = 0;
+    unsigned i, n, pass;
+    clock_t start;
+    double walk, scan;
+
+    start = clock();
+    for (pass = 0; pass < SCAN_PASSES; pass++) {
+        for (pNode = cacheMgmt.tavl.lowest.higher; &cacheMgmt.tavl.highest != pNode; pNode = pNode->higher) {
+            walkSum += pNode->pSeg->key + pNode->pSeg->numberOfBlocks + (&cacheMgmt.dirty == pNode->pSeg->pList);
+        }
+    }
+    walk = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    start = clock();
+    for (pass = 0; pass < SCAN_PASSES; pass++) {
+        tavlCursorInit(&cursor, &cacheMgmt.tavl, 0, UINT_MAX);
+        while (0 < (n = tavlCursorNext(&cursor, entries, LOOKUP_BATCH))) {
+            for (i = 0; i < n; i++) {
+                cursorSum += entries[i].key + entries[i].numberOfBlocks + (BLOCK_DIRTY == entries[i].state);
+            }
+        }
+    }
+    scan = (double)(clock() - start) / CLOCKS_PER_SEC;
+    assert(walkSum == cursorSum);
+
+    printf("Scan   segments:%-8d passes:%-3d Thread walk %6.1f ms/scan  cursor %6.1f ms/scan  (%.2fx)\n",
+        cacheMgmt.tavl.active_nodes, SCAN_PASSES, 1000 * walk / SCAN_PASSES, 1000 * scan / SCAN_PASSES,
+        walk / (scan > 0 ? scan : 1e-9));
+}
+
+/**
+ *  @brief  Compares point lookups in a single AVL tree against the radix-directed tree
+ *          Both hold the same 2^20 segments and answer the same random LBAs.
+ *  @param  unsigned loops - number of lookups
+ *          unsigned pageSize - POOL_PAGE_* of the segment and node pool
+ *  @return None
+ */
+static void benchLookup(unsigned loops, unsigned pageSize) {
+    static const char *names[] = {"malloc", "small", "THP", "2M", "1G"};
+    poolPlacement_t placement = {pageSize, false, 0};
+    poolMapping_t segsMapping, nodesMapping;
+    rtavl_t radix;
+    segment_t **segs, *rSegs;
+    tavl_node_t *rNodes;
+    unsigned *lbas, *found;
+    unsigned i, sum = 0;
+    clock_t start;
+    double single, radixed;
+
+    srand(BENCH_SEED);
+    setPoolPlacement(pageSize, false, 0);
+    initCache(LOOKUP_SEGMENTS);
+    setPoolPlacement(POOL_PAGE_DEFAULT, false, 0);
+    segs = malloc(sizeof(segment_t *) * LOOKUP_SEGMENTS);
+    lbas = malloc(sizeof(unsigned) * loops);
+    found = malloc(sizeof(unsigned) * loops);
+    assert((NULL != segs) && (NULL != lbas) && (NULL != found));
+
+    // Non-overlapping segments at random offsets. As after a long churn, neighbors in the Thread
+    // are scattered over the pool, and got inserted in random order.
+    for (i = 0; i < LOOKUP_SEGMENTS; i++) {
+        segs[i] = popFromHead(&cacheMgmt.free);
+        initSegment(segs[i]);
+    }
+    shuffleSegments(segs, LOOKUP_SEGMENTS);
+    for (i = 0; i < LOOKUP_SEGMENTS; i++) {
+        segs[i]->key = i*LOOKUP_STRIDE + rand()%(LOOKUP_STRIDE/2);
+        segs[i]->numberOfBlocks = 10+(rand()%20);
+    }
+    shuffleSegments(segs, LOOKUP_SEGMENTS);
+    for (i = 0; i < loops; i++) {
+        lbas[i] = rand() % (LOOKUP_SEGMENTS*LOOKUP_STRIDE);
+    }
+
+    for (i = 0; i < LOOKUP_SEGMENTS; i++) {
+        initNode(segs[i]->pNode);
+        cacheMgmt.tavl.root = insertToTavl(&cacheMgmt.tavl, (tavl_node_t *)(segs[i]->pNode));
+    }
+    start = clock();
+    for (i = 0; i < loops; i++) {
+        found[i] = lookupKey(searchTavl(cacheMgmt.tavl.root, lbas[i]), &cacheMgmt.tavl);
+    }
+    single = (double)(clock() - start) / CLOCKS_PER_SEC;
+    benchScan();
+
+    // Same segments in the radix-directed tree. It is a standalone index, so it gets segments and nodes
+    // of its own, placed as the pool is.
+    rSegs = poolAlloc(sizeof(segment_t) * LOOKUP_SEGMENTS, &placement, &segsMapping);
+    rNodes = poolAlloc(sizeof(tavl_node_t) * LOOKUP_SEGMENTS, &placement, &nodesMapping);
+    assert((NULL != rSegs) && (NULL != rNodes));
+    assert(initRtavl(&radix, LOOKUP_SHIFT, LOOKUP_BUCKETS));
+    for (i = 0; i < LOOKUP_SEGMENTS; i++) {
+        initSegment(&rSegs[i]);
+        initNode(&rNodes[i]);
+        rNodes[i].pSeg = &rSegs[i];
+        rSegs[i].pNode = (void *)&rNodes[i];
+        rSegs[i].key = segs[i]->key;
+        rSegs[i].numberOfBlocks = segs[i]->numberOfBlocks;
+        insertToRtavl(&radix, &rNodes[i]);
+    }
+    start = clock();
+    for (i = 0; i < loops; i++) {
+        sum += (found[i] != lookupKey(searchRtavl(&radix, lbas[i]), &radix.tavl));
+    }
+    radixed = (double)(clock() - start) / CLOCKS_PER_SEC;
+    assert(0 == sum);
+
+    printf("Lookup segments:%-8d loops:%-8d pages:%-6s  single tree %8.0f lookups/s  radix %8.0f lookups/s  (%.2fx)\n",
+        LOOKUP_SEGMENTS, loops, names[cacheMgmt.chunks->nodesMapping.pageSize],
+        loops / (single > 0 ? single : 1e-9), loops / (radixed > 0 ? radixed : 1e-9),
+        single / (radixed > 0 ? radixed : 1e-9));
+
+    // Give the pool back.
+    freeRtavl(&radix);
+    poolFree(rSegs, &segsMapping);
+    poolFree(rNodes, &nodesMapping);
+    initTavl(&cacheMgmt.tavl);
+    for (i = 0; i < LOOKUP_SEGMENTS; i++) {
+        initSegment(segs[i]);
+        pushToTail(segs[i], &cacheMgmt.free);
+    }
+    free(segs);
+    free(lbas);
+    free(found);
+    shrinkCache(cacheMgmt.chunks);
+    assert(drainChunk(cacheMgmt.chunks, UINT_MAX));
+}
+
+int main(int argc, char *argv[]) {
+    unsigned loops = BENCH_LOOP;
+
+    if (1 < argc) {
+        loops = (unsigned)strtoul(argv[1], NULL, 0);
+    }
+
+    printf("Random delete/insert loop, AVL vs WAVL\n");
+    // Same shape as main.c - 100 segments over 20000 LBAs.
+    benchChurn(100, 20000, loops, false);
+    benchChurn(100, 20000, loops, true);
+    // Larger caches with the same density.
+    benchChurn(10000, 2000000, loops, false);
+    benchChurn(10000, 2000000, loops, true);
+    benchChurn(1000000, 200000000, loops, false);
+    benchChurn(1000000, 200000000, loops, true);
+
+    printf("Point lookups, single tree vs radix-directed tree, and full Thread scans\n");
+    benchLookup(4 * loops, POOL_PAGE_DEFAULT);
+    // Same with hugepages, falling back to transparent hugepages if none are reserved.
+    benchLookup(4 * loops, POOL_PAGE_2M);
+    return 0;
+}
@@ -0,0 +1,332 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <assert.h>
+#include "tavl.h"
+#include "journal.h"
+
+//-----------------------------------------------------------
+// Functions
+//-----------------------------------------------------------
+/**
+ *  @brief  Fills in a record with its check word
+ *  @param  journalRecord_t *pRecord - the record
+ *          unsigned type - record type, unsigned lba - first LBA, unsigned numberOfBlocks - number of blocks
+ *  @return None
+ */
+static void setRecord(journalRecord_t *pRecord, unsigned type, unsigned lba, unsigned numberOfBlocks) {
+    pRecord->type = type;
+    pRecord->lba = lba;
+    pRecord->numberOfBlocks = numberOfBlocks;
+    pRecord->check = type ^ lba ^ numberOfBlocks ^ JOURNAL_MAGIC;
+}
+
+/**
+ *  @brief  Tells whether a record read back is intact
+ *  @param  journalRecord_t *pRecord - the record
+ *  @return bool - true if the record can be applied
+ */
+static bool validRecord(journalRecord_t *pRecord) {
+    if ((pRecord->type ^ pRecord->lba ^ pRecord->numberOfBlocks ^ JOURNAL_MAGIC) != pRecord->check) {
+        return false;
+    }
+    return (JOURNAL_DIRTY <= pRecord->type) && (JOURNAL_CLEAN >= pRecord->type);
+}
+
+/**
+ *  @brief  Writes the whole buffer, retrying short writes
+ *  @param  int fd - file, const void *pBuffer - data, size_t size - bytes
+ *  @return bool - false on an I/O error
+ */
+static bool writeAll(int fd, const void *pBuffer, size_t size) {
+    const char *p = pBuffer;
+    ssize_t n;
+
+    while (0 < size) {
+        n = write(fd, p, size);
+        if (0 > n) {
+            if (EINTR == errno) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+/**
+ *  @brief  Makes a file creation or rename in the directory of the given path durable
+ *  @param  const char *path - path of a file
+ *  @return bool - false on an I/O error
+ */
+static bool syncDirectory(const char *path) {
+    char *dir = strdup(path);
+    char *slash;
+    int fd;
+    bool ok;
+
+    if (NULL == dir) {
+        return false;
+    }
+    slash = strrchr(dir, '/');
+    if (NULL == slash) {
+        strcpy(dir, ".");
+    } else if (slash == dir) {
+        dir[1] = '\0';
+    } else {
+        *slash = '\0';
+    }
+    fd = open(dir, O_RDONLY);
+    free(dir);
+    if (0 > fd) {
+        return false;
+    }
+    ok = (0 == fsync(fd));
+    close(fd);
+    return ok;
+}
+
+/**
+ *  @brief  Adds a record to the checkpoint buffer, writing the buffer out once full
+ *  @param  int fd - checkpoint file, journalRecord_t *records - JOURNAL_BATCH records, unsigned *pNumOfRecords - records in use
+ *          unsigned type - record type, unsigned lba - first LBA, unsigned numberOfBlocks - number of blocks
+ *  @return bool - false on an I/O error
+ */
+static bool putRecord(int fd, journalRecord_t *records, unsigned *pNumOfRecords,
+    unsigned type, unsigned lba, unsigned numberOfBlocks) {
+    setRecord(&records[(*pNumOfRecords)++], type, lba, numberOfBlocks);
+    if (JOURNAL_BATCH == *pNumOfRecords) {
+        *pNumOfRecords = 0;
+        return writeAll(fd, records, sizeof(journalRecord_t) * JOURNAL_BATCH);
+    }
+    return true;
+}
+
+bool openJournal(journal_t *pJournal, const char *path) {
+    pJournal->path = strdup(path);
+    pJournal->maxRecords = JOURNAL_BATCH;
+    pJournal->maxSpare = JOURNAL_BATCH;
+    pJournal->pBuffer = malloc(sizeof(journalRecord_t) * JOURNAL_BATCH);
+    pJournal->pSpare = malloc(sizeof(journalRecord_t) * JOURNAL_BATCH);
+    pJournal->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if ((NULL == pJournal->path) || (NULL == pJournal->pBuffer) || (NULL == pJournal->pSpare) ||
+        (0 > pJournal->fd) || (false == syncDirectory(path))) {
+        if (0 <= pJournal->fd) {
+            close(pJournal->fd);
+        }
+        free(pJournal->path);
+        free(pJournal->pBuffer);
+        free(pJournal->pSpare);
+        return false;
+    }
+    pthread_mutex_init(&pJournal->lock, NULL);
+    pthread_cond_init(&pJournal->done, NULL);
+    pJournal->numOfRecords = 0;
+    pJournal->appended = 0;
+    pJournal->durable = 0;
+    pJournal->flushing = false;
+    pJournal->failed = false;
+    pJournal->batches = 0;
+    pJournal->logBytes = 0;
+    pJournal->checkpointBytes = JOURNAL_CHECKPOINT;
+    return true;
+}
+
+bool closeJournal(journal_t *pJournal) {
+    bool ok = journalCommit(pJournal, pJournal->appended);
+
+    close(pJournal->fd);
+    pthread_cond_destroy(&pJournal->done);
+    pthread_mutex_destroy(&pJournal->lock);
+    free(pJournal->path);
+    free(pJournal->pBuffer);
+    free(pJournal->pSpare);
+    return ok;
+}
+
+uint64_t journalAppend(journal_t *pJournal, unsigned type, unsigned lba, unsigned numberOfBlocks) {
+    journalRecord_t *pBuffer;
+    uint64_t seq;
+
+    assert((JOURNAL_DIRTY <= type) && (JOURNAL_CLEAN >= type));
+    pthread_mutex_lock(&pJournal->lock);
+    if (pJournal->maxRecords == pJournal->numOfRecords) {
+        // The leader is slow. Let the next batch grow rather than blocking the cache.
+        pBuffer = realloc(pJournal->pBuffer, sizeof(journalRecord_t) * pJournal->maxRecords * 2);
+        if (NULL == pBuffer) {
+            pthread_mutex_unlock(&pJournal->lock);
+            return 0;
+        }
+        pJournal->pBuffer = pBuffer;
+        pJournal->maxRecords *= 2;
+    }
+    setRecord(&pJournal->pBuffer[pJournal->numOfRecords], type, lba, numberOfBlocks);
+    pJournal->numOfRecords++;
+    seq = ++pJournal->appended;
+    pthread_mutex_unlock(&pJournal->lock);
+    return seq;
+}
+
+bool journalCommit(journal_t *pJournal, uint64_t seq) {
+    journalRecord_t *pBatch;
+    unsigned numOfRecords, maxRecords;
+    uint64_t batchEnd;
+    bool ok;
+
+    pthread_mutex_lock(&pJournal->lock);
+    while ((pJournal->durable < seq) && (false == pJournal->failed)) {
+        if (pJournal->flushing) {
+            // Someone else is the leader. Our record is either in its batch or in the next one.
+            pthread_cond_wait(&pJournal->done, &pJournal->lock);
+            continue;
+        }
+        // Become the leader. Take everything appended so far, and let appends go to the spare buffer.
+        pJournal->flushing = true;
+        pBatch = pJournal->pBuffer;
+        maxRecords = pJournal->maxRecords;
+        numOfRecords = pJournal->numOfRecords;
+        batchEnd = pJournal->appended;
+        pJournal->pBuffer = pJournal->pSpare;
+        pJournal->maxRecords = pJournal->maxSpare;
+        pJournal->numOfRecords = 0;
+        pthread_mutex_unlock(&pJournal->lock);
+
+        ok = writeAll(pJournal->fd, pBatch, sizeof(journalRecord_t) * numOfRecords) &&
+             (0 == fdatasync(pJournal->fd));
+
+        pthread_mutex_lock(&pJournal->lock);
+        pJournal->pSpare = pBatch;
+        pJournal->maxSpare = maxRecords;
+        pJournal->flushing = false;
+        pJournal->batches++;
+        if (ok) {
+            pJournal->durable = batchEnd;
+            pJournal->logBytes += sizeof(journalRecord_t) * numOfRecords;
+        } else {
+            pJournal->failed = true;
+        }
+        pthread_cond_broadcast(&pJournal->done);
+    }
+    ok = (pJournal->durable >= seq);
+    pthread_mutex_unlock(&pJournal->lock);
+    return ok;
+}
+
+bool journalCheckpointDue(journal_t *pJournal) {
+    bool due;
+
+    pthread_mutex_lock(&pJournal->lock);
+    due = (pJournal->logBytes >= pJournal->checkpointBytes);
+    pthread_mutex_unlock(&pJournal->lock);
+    return due;
+}
+
+bool journalCheckpoint(journal_t *pJournal) {
+    journalRecord_t records[JOURNAL_BATCH];
+    unsigned numOfRecords = 0, lba, numberOfBlocks, state;
+    size_t length = strlen(pJournal->path);
+    char *tmpPath = malloc(length + sizeof(".tmp"));
+    segment_t *pSeg;
+    bool ok;
+    int fd;
+
+    if (NULL == tmpPath) {
+        return false;
+    }
+    memcpy(tmpPath, pJournal->path, length);
+    memcpy(tmpPath + length, ".tmp", sizeof(".tmp"));
+
+    pthread_mutex_lock(&pJournal->lock);
+    while (pJournal->flushing) {
+        pthread_cond_wait(&pJournal->done, &pJournal->lock);
+    }
+    fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ok = (0 <= fd);
+
+    // Each dirty segment as a whole, then its holes and clean blocks, so that replay rebuilds the same
+    // segments rather than one per run. Clean segments need no recovery.
+    for (pSeg = cacheMgmt.dirty.head.next; ok && (&cacheMgmt.dirty.tail != pSeg); pSeg = pSeg->next) {
+        ok = putRecord(fd, records, &numOfRecords, JOURNAL_DIRTY, pSeg->key, pSeg->numberOfBlocks);
+        // Offsets are compared, as the end of a segment at the top of the LBA space wraps around to 0.
+        for (lba = pSeg->key; ok && (lba - pSeg->key < pSeg->numberOfBlocks); lba += numberOfBlocks) {
+            numberOfBlocks = blockRun(pSeg, lba, &state);
+            if (BLOCK_DIRTY != state) {
+                ok = putRecord(fd, records, &numOfRecords,
+                    (BLOCK_INVALID == state) ? JOURNAL_TRIM : JOURNAL_CLEAN, lba, numberOfBlocks);
+            }
+        }
+    }
+    ok = ok && writeAll(fd, records, sizeof(journalRecord_t) * numOfRecords) &&
+        (0 == fdatasync(fd)) && (0 == rename(tmpPath, pJournal->path)) && syncDirectory(pJournal->path);
+
+    if (ok) {
+        // Everything appended is in the new log, as part of the dirty set.
+        close(pJournal->fd);
+        pJournal->fd = fd;
+        pJournal->numOfRecords = 0;
+        pJournal->durable = pJournal->appended;
+        pJournal->logBytes = 0;
+        pthread_cond_broadcast(&pJournal->done);
+    } else if (0 <= fd) {
+        close(fd);
+        unlink(tmpPath);
+    }
+    pthread_mutex_unlock(&pJournal->lock);
+    free(tmpPath);
+    return ok;
+}
+
+bool replayJournal(const char *path, unsigned *pNumOfRecords) {
+    journalRecord_t record;
+    off_t length = 0;
+    bool ok = true;
+    FILE *fp;
+
+    *pNumOfRecords = 0;
+    fp = fopen(path, "r+b");
+    if (NULL == fp) {
+        return (ENOENT == errno);
+    }
+    while (1 == fread(&record, sizeof(record), 1, fp)) {
+        if (false == validRecord(&record)) {
+            break;
+        }
+        switch (record.type) {
+        case JOURNAL_DIRTY:
+            // Rebuilt, the dirty set may take more segments than it did, as writes were merged into clean
+            // segments that are not journaled. Grow the pool rather than lose dirty data.
+            while ((false == (ok = writeToCache(record.lba, record.numberOfBlocks))) &&
+                (NULL != growCache(JOURNAL_GROW))) {
+            }
+            break;
+        case JOURNAL_TRIM:
+            ok = invalidateRange(record.lba, record.numberOfBlocks);
+            break;
+        case JOURNAL_CLEAN:
+            ok = cleanRange(record.lba, record.numberOfBlocks);
+            break;
+        }
+        if (false == ok) {
+            fclose(fp);
+            return false;
+        }
+        length += sizeof(record);
+        (*pNumOfRecords)++;
+    }
+    if (ferror(fp)) {
+        fclose(fp);
+        return false;
+    }
+    // Drop a torn tail, so that new records are not appended after garbage.
+    fflush(fp);
+    if ((0 != ftruncate(fileno(fp), length)) || (0 != fsync(fileno(fp)))) {
+        ok = false;
+    }
+    fclose(fp);
+    return ok;
+}
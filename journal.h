@@ -0,0 +1,122 @@
+#ifndef __JOURNAL_H
+#define __JOURNAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+//-----------------------------------------------------------
+// Macros
+//-----------------------------------------------------------
+// Record types
+#define JOURNAL_DIRTY       (1)     // Blocks written to the cache, not yet to the media
+#define JOURNAL_TRIM        (2)     // Blocks invalidated, dirty or not
+#define JOURNAL_CLEAN       (3)     // Dirty blocks written to the media - destage complete
+
+#define JOURNAL_MAGIC       (0x4a524e4cU)
+#define JOURNAL_BATCH       (256)   // Initial number of records buffered per batch
+#define JOURNAL_CHECKPOINT  (1 << 20) // Default log growth in bytes after which a checkpoint is due
+#define JOURNAL_GROW        (64)    // Segments added to the pool when replay runs out of them
+
+//-----------------------------------------------------------
+// Structure definitions
+//-----------------------------------------------------------
+// One change of the dirty set. Fixed size, so a torn tail is a short or mismatching record.
+typedef struct journalRecord {
+    uint32_t    type;
+    uint32_t    lba;
+    uint32_t    numberOfBlocks;
+    uint32_t    check;      // type ^ lba ^ numberOfBlocks ^ JOURNAL_MAGIC
+} journalRecord_t;
+
+// Append-only journal with group commit.
+// Records are appended to a buffer under the cache lock, then committed outside of it.
+// The first committer becomes the leader, writing the buffer with one fdatasync while later
+// records pile up in the other buffer, and being committed by the next leader as one batch.
+typedef struct journal {
+    int             fd;
+    char            *path;
+    pthread_mutex_t lock;
+    pthread_cond_t  done;
+    journalRecord_t *pBuffer;       // records appended since the last batch
+    unsigned        numOfRecords;
+    unsigned        maxRecords;
+    journalRecord_t *pSpare;        // records being written by the leader
+    unsigned        maxSpare;
+    uint64_t        appended;       // sequence number of the last appended record
+    uint64_t        durable;        // sequence number of the last record on stable storage
+    bool            flushing;       // a leader is writing a batch
+    bool            failed;         // an I/O error happened. Nothing is durable afterwards.
+    unsigned long   batches;        // number of fdatasync calls
+    off_t           logBytes;       // bytes written since the last checkpoint
+    off_t           checkpointBytes;
+} journal_t;
+
+//-----------------------------------------------------------
+// Functions
+//-----------------------------------------------------------
+/**
+ *  @brief  Opens the journal file for appending, creating it if needed.
+ *          Replay an existing journal with replayJournal() first.
+ *  @param  journal_t *pJournal - the journal
+ *          const char *path - path of the journal file
+ *  @return bool - false if the file could not be opened
+ */
+extern bool openJournal(journal_t *pJournal, const char *path);
+
+/**
+ *  @brief  Commits anything left and closes the journal
+ *  @param  journal_t *pJournal - the journal
+ *  @return bool - false if anything appended could not be made durable
+ */
+extern bool closeJournal(journal_t *pJournal);
+
+/**
+ *  @brief  Appends a change of the dirty set to the journal, in memory.
+ *          Call under the same lock as the cache update, so the records are in the order of the updates.
+ *  @param  journal_t *pJournal - the journal
+ *          unsigned type - JOURNAL_DIRTY, JOURNAL_TRIM or JOURNAL_CLEAN
+ *          unsigned lba - first LBA, unsigned numberOfBlocks - number of blocks
+ *  @return Sequence number of the record, to be passed to journalCommit().
+ *          0 if the buffer could not grow. Nothing is appended then, and the update is not to be acknowledged.
+ */
+extern uint64_t journalAppend(journal_t *pJournal, unsigned type, unsigned lba, unsigned numberOfBlocks);
+
+/**
+ *  @brief  Waits until the record of the given sequence number, and all before it, are on stable storage.
+ *          Call without the cache lock, so that concurrent writers can join the batch.
+ *  @param  journal_t *pJournal - the journal, uint64_t seq - sequence number returned by journalAppend()
+ *  @return bool - false on an I/O error
+ */
+extern bool journalCommit(journal_t *pJournal, uint64_t seq);
+
+/**
+ *  @brief  Tells whether the log has grown enough since the last checkpoint to be compacted
+ *  @param  journal_t *pJournal - the journal
+ *  @return bool - true if journalCheckpoint() is due
+ */
+extern bool journalCheckpointDue(journal_t *pJournal);
+
+/**
+ *  @brief  Compacts the log into the current dirty set of the cache.
+ *          Writes one JOURNAL_DIRTY record per run of dirty blocks to a new file, and atomically
+ *          replaces the log with it. Records appended but not yet committed are covered by the new file.
+ *          Call under the cache lock.
+ *  @param  journal_t *pJournal - the journal
+ *  @return bool - false on an I/O error. The old log is left in place then.
+ */
+extern bool journalCheckpoint(journal_t *pJournal);
+
+/**
+ *  @brief  Rebuilds the dirty set of the cache from the given journal file, at startup.
+ *          Replay stops at the first torn or corrupt record, and the file is truncated there.
+ *          If the dirty set does not fit, the pool is grown with growCache(). Shrink it once destaged.
+ *  @param  const char *path - path of the journal file
+ *          unsigned *pNumOfRecords - set to the number of records replayed
+ *  @return bool - false if the file could not be read, or a record could not be applied.
+ *          A missing file is an empty journal.
+ */
+extern bool replayJournal(const char *path, unsigned *pNumOfRecords);
+
+#endif // __JOURNAL_H
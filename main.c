@@ -4,16 +4,29 @@
 #include <signal.h>
 #endif
 #include <stdlib.h>
+#include <limits.h>
 #include <time.h>
 #include <assert.h>
 #include <stddef.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdint.h>
 #include "tavl.h"
+#include "rtavl.h"
+#include "journal.h"
+#include "mq.h"
 
 //-----------------------------------------------------------
 // Macros
 //-----------------------------------------------------------
 #define NUM_OF_SEGMENTS (100)
 #define TEST_LOOP       (1000000)
+#define JOURNAL_PATH    "test.journal"
+#define JOURNAL_LBAS    (20100)
+#define JOURNAL_THREADS (4)
+#define MQ_THREADS      (4)
+#define MQ_DEPTH        (16)
 
 //-----------------------------------------------------------
 // Global variables
@@ -23,6 +36,1238 @@
 //-----------------------------------------------------------
 // Functions
 //-----------------------------------------------------------
+/**
+ *  @brief  Fills the cache with non overlapping LRU segments and checks that
+ *          polled reclaim steps refill the free list up to the high watermark
+ *          without ever evicting a pinned segment.
+ *  @param  None
+ *  @return None
+ */
+static void testReclaim(void) {
+    segment_t *tSeg, *pinnedSeg;
+    segList_t held;
+    unsigned i, evicted, total;
+
+    printf("Testing background reclaim with free list watermarks\n");
+    setWatermarks(NUM_OF_SEGMENTS/10, NUM_OF_SEGMENTS/4);
+    // Nothing to do while the free list is above the low watermark.
+    assert(0==reclaimCache(NUM_OF_SEGMENTS));
+
+    // Fill the cache till the free list drops below the low watermark.
+    i=0;
+    while (cacheMgmt.free.count >= cacheMgmt.lowWatermark) {
+        tSeg=allocSegment();
+        assert(NULL!=tSeg);
+        initSegment(tSeg);
+        initNode(tSeg->pNode);
+        tSeg->key = i*100;
+        tSeg->numberOfBlocks = 10+(rand()%20);
+        cacheMgmt.tavl.root = insertToTavl(&cacheMgmt.tavl, (tavl_node_t *)(tSeg->pNode));
+        pushToTail(tSeg, &cacheMgmt.lru);
+        i++;
+    }
+    assert(cacheMgmt.lru.count==i);
+
+    // Pin the oldest segments, more of them than a batch. They must survive the reclaim, and must not stall it.
+    pinnedSeg=cacheMgmt.lru.head.next;
+    for (i = 0, tSeg = pinnedSeg; i < 8; i++, tSeg = tSeg->next) {
+        tSeg->refCount++;
+    }
+
+    // Reclaim in small batches, as an idle loop would.
+    assert(4==reclaimCache(4));
+    total=4;
+    do {
+        evicted=reclaimCache(4);
+        assert(evicted<=4);
+        total+=evicted;
+    } while (0!=evicted);
+    printf("Reclaimed %d segments, free:%d, lru:%d\n", total, cacheMgmt.free.count, cacheMgmt.lru.count);
+    assert(cacheMgmt.free.count==cacheMgmt.highWatermark);
+    assert(cacheMgmt.lru.head.next==pinnedSeg);
+    for (i = 0, tSeg = pinnedSeg; i < 8; i++, tSeg = tSeg->next) {
+        assert(NULL!=searchAvl(cacheMgmt.tavl.root, tSeg->key));
+    }
+    // The free list is above the low watermark again, so the next poll is a no-op.
+    assert(0==reclaimCache(NUM_OF_SEGMENTS));
+    tavlSanityCheck(&cacheMgmt.tavl);
+    assert(tavlHeightCheck(cacheMgmt.tavl.root));
+
+    // Foreground allocation still works once the free list runs dry.
+    initSegment(&held.head);
+    initSegment(&held.tail);
+    held.head.next=&held.tail;
+    held.tail.prev=&held.head;
+    held.count=0;
+    while (NULL!=(tSeg=popFromHead(&cacheMgmt.free))) {
+        pushToTail(tSeg, &held);
+    }
+    tSeg=allocSegment();
+    assert(NULL!=tSeg);
+    assert(tSeg!=pinnedSeg);
+    pushToTail(tSeg, &cacheMgmt.free);
+    while (NULL!=(tSeg=popFromHead(&held))) {
+        pushToTail(tSeg, &cacheMgmt.free);
+    }
+
+    for (i = 0, tSeg = pinnedSeg; i < 8; i++, tSeg = tSeg->next) {
+        tSeg->refCount--;
+    }
+    setWatermarks(0, 0);
+    while (&cacheMgmt.lru.tail!=cacheMgmt.lru.head.next) {
+        freeNode(cacheMgmt.lru.head.next);
+    }
+    assert(NULL==cacheMgmt.tavl.root);
+    assert(NUM_OF_SEGMENTS==cacheMgmt.free.count);
+}
+
+/**
+ *  @brief  Grows the pool with a second chunk, churns the tree so that segments and nodes
+ *          of both chunks get mixed, then drains the second chunk back out in bounded steps
+ *          and checks that the segments of the first chunk keep their contents.
+ *  @param  None
+ *  @return None
+ */
+static void testPoolResize(void) {
+    poolChunk_t *pChunk;
+    segment_t *tSeg, *dirtySeg;
+    tavl_node_t *cNode;
+    segList_t held;
+    unsigned i, steps, survivors;
+    unsigned const grow=NUM_OF_SEGMENTS/2;
+
+    printf("Testing runtime pool growth and shrink\n");
+    pChunk=growCache(grow);
+    assert(NULL!=pChunk);
+    assert(NUM_OF_SEGMENTS+grow==cacheMgmt.numOfNodes);
+    assert(NUM_OF_SEGMENTS+grow==cacheMgmt.free.count);
+
+    // Fill the whole pool, then free random segments and refill to shuffle the segment to node pairing.
+    for (i = 0; i < 4*cacheMgmt.numOfNodes; i++) {
+        if (0==cacheMgmt.free.count) {
+            do {
+                cNode=searchTavl(cacheMgmt.tavl.root, rand()%(200*cacheMgmt.numOfNodes));
+            } while ((NULL==cNode)||(&cacheMgmt.tavl.lowest==cNode));
+            freeNode(cNode->pSeg);
+        }
+        tSeg=popFromHead(&cacheMgmt.free);
+        initSegment(tSeg);
+        initNode(tSeg->pNode);
+        // Pick a free slot on a 100 block grid so that nothing overlaps.
+        do {
+            tSeg->key=100*(rand()%(2*cacheMgmt.numOfNodes));
+        } while (NULL!=searchAvl(cacheMgmt.tavl.root, tSeg->key));
+        tSeg->numberOfBlocks=10+(rand()%20);
+        cacheMgmt.tavl.root = insertToTavl(&cacheMgmt.tavl, (tavl_node_t *)(tSeg->pNode));
+        pushToTail(tSeg, &cacheMgmt.lru);
+    }
+    assert(cacheMgmt.numOfNodes==cacheMgmt.lru.count+cacheMgmt.free.count);
+
+    // Make one segment of the chunk dirty. It must hold off the drain till it is written.
+    dirtySeg=&pChunk->pSegments[grow/2];
+    if (&cacheMgmt.free==dirtySeg->pList) {
+        removeFromList(dirtySeg);
+        initSegment(dirtySeg);
+        initNode(dirtySeg->pNode);
+        do {
+            dirtySeg->key=100*(rand()%(2*cacheMgmt.numOfNodes));
+        } while (NULL!=searchAvl(cacheMgmt.tavl.root, dirtySeg->key));
+        dirtySeg->numberOfBlocks=10;
+        cacheMgmt.tavl.root = insertToTavl(&cacheMgmt.tavl, (tavl_node_t *)(dirtySeg->pNode));
+    }
+    moveToList(dirtySeg, &cacheMgmt.dirty);
+
+    // Remember how many segments of the first chunk are cached. Those must survive the drain.
+    survivors=0;
+    for (i = 0; i < NUM_OF_SEGMENTS; i++) {
+        if (&cacheMgmt.lru==pSegmentPool[i].pList) {
+            survivors++;
+        }
+    }
+
+    shrinkCache(pChunk);
+
+    // With the free list empty and segments of the draining chunk oldest in the LRU list,
+    // a foreground allocation evicts past them, as they are retired rather than freed.
+    initSegment(&held.head);
+    initSegment(&held.tail);
+    held.head.next=&held.tail;
+    held.tail.prev=&held.head;
+    held.count=0;
+    while (NULL!=(tSeg=popFromHead(&cacheMgmt.free))) {
+        pushToTail(tSeg, &held);
+    }
+    for (i = 0; i < NUM_OF_SEGMENTS; i++) {
+        if (&cacheMgmt.lru==pSegmentPool[i].pList) {
+            moveToList(&pSegmentPool[i], &cacheMgmt.lru);
+        }
+    }
+    assert(cacheMgmt.lru.head.next->pChunk==pChunk);
+    tSeg=allocSegment();
+    assert((NULL!=tSeg)&&(tSeg->pChunk!=pChunk));
+    survivors--;
+    pushToTail(tSeg, &cacheMgmt.free);
+    while (NULL!=(tSeg=popFromHead(&held))) {
+        pushToTail(tSeg, &cacheMgmt.free);
+    }
+
+    steps=0;
+    while (false==drainChunk(pChunk, 8)) {
+        steps++;
+        assert(steps<1000);
+        if (steps==100) {
+            // Write is done. The dirty segment becomes clean and can be drained.
+            moveToList(dirtySeg, &cacheMgmt.lru);
+        }
+        if (steps<100) {
+            assert(&cacheMgmt.dirty==dirtySeg->pList);
+        }
+    }
+    printf("Drained a chunk of %d segments in %d steps\n", grow, steps+1);
+    assert(NUM_OF_SEGMENTS==cacheMgmt.numOfNodes);
+    assert(survivors==cacheMgmt.lru.count);
+    assert(cacheMgmt.numOfNodes==cacheMgmt.lru.count+cacheMgmt.free.count);
+    assert((unsigned)cacheMgmt.tavl.active_nodes==cacheMgmt.lru.count);
+    // Every segment and node left in use belongs to the first chunk.
+    cNode=cacheMgmt.tavl.lowest.higher;
+    while (&cacheMgmt.tavl.highest!=cNode) {
+        assert(cNode->pSeg->pChunk==cacheMgmt.chunks);
+        assert((cNode>=pNodePool)&&(cNode<pNodePool+NUM_OF_SEGMENTS));
+        cNode=cNode->higher;
+    }
+    tavlSanityCheck(&cacheMgmt.tavl);
+    assert(tavlHeightCheck(cacheMgmt.tavl.root));
+
+    while (&cacheMgmt.lru.tail!=cacheMgmt.lru.head.next) {
+        freeNode(cacheMgmt.lru.head.next);
+    }
+    assert(NULL==cacheMgmt.tavl.root);
+    assert(NUM_OF_SEGMENTS==cacheMgmt.free.count);
+}
+
+/**
+ *  @brief  Inserts the given segment into the TAVL tree and the LRU list,
+ *          invalidating any segment that overlaps with it, the same way main() does.
+ *  @param  segment_t *tSeg - segment with key and number of blocks set
+ *  @return None
+ */
+static void insertWithCoherency(segment_t *tSeg) {
+    tavl_node_t *cNode, *higherNode;
+
+    cNode=searchTavl(cacheMgmt.tavl.root, tSeg->key);
+    if ((NULL!=cNode) && (&cacheMgmt.tavl.lowest!=cNode)) {
+        if ((cNode->pSeg->key+cNode->pSeg->numberOfBlocks)>tSeg->key) {
+            freeNode(cNode->pSeg);
+        }
+    }
+    cacheMgmt.tavl.root = insertToTavl(&cacheMgmt.tavl, (tavl_node_t *)(tSeg->pNode));
+    pushToTail(tSeg, &cacheMgmt.lru);
+    higherNode=((tavl_node_t *)(tSeg->pNode))->higher;
+    while (&cacheMgmt.tavl.highest!=higherNode) {
+        if (higherNode->pSeg->key>=(tSeg->key+tSeg->numberOfBlocks)) {
+            break;
+        }
+        freeNode(higherNode->pSeg);
+        higherNode=((tavl_node_t *)(tSeg->pNode))->higher;
+    }
+}
+
+/**
+ *  @brief  Runs the random delete and add loop on a WAVL tree.
+ *          Checks the rank rule, that removals take at most two rotations,
+ *          and that insert-only workloads still build an AVL tree.
+ *  @param  None
+ *  @return None
+ */
+static void testWavl(void) {
+    segment_t *tSeg;
+    tavl_node_t *cNode;
+    unsigned i;
+    unsigned long before;
+
+    printf("Testing WAVL (rank-balanced) rebalancing\n");
+    setRankBalanced(&cacheMgmt.tavl, true);
+
+    // Insert only - the tree must be an AVL tree.
+    for (i = 0; i < NUM_OF_SEGMENTS; i++) {
+        tSeg=popFromHead(&cacheMgmt.free);
+        initSegment(tSeg);
+        initNode(tSeg->pNode);
+        tSeg->key = i*100;
+        tSeg->numberOfBlocks = 10+(rand()%20);
+        cacheMgmt.tavl.root = insertToTavl(&cacheMgmt.tavl, (tavl_node_t *)(tSeg->pNode));
+        pushToTail(tSeg, &cacheMgmt.lru);
+    }
+    assert(wavlRankCheck(cacheMgmt.tavl.root));
+    assert(tavlHeightCheck(cacheMgmt.tavl.root));
+
+    for (i = 0; i < TEST_LOOP/10; i++) {
+        while (NULL==(tSeg=popFromHead(&cacheMgmt.free))) {
+            do {
+                cNode=searchTavl(cacheMgmt.tavl.root, rand() % 20000);
+            } while (NULL==cNode);
+            if (&cacheMgmt.tavl.lowest==cNode) {
+                cNode=cNode->higher;
+            }
+            before=tavlRotations;
+            freeNode(cNode->pSeg);
+            assert(tavlRotations-before<=2);
+        }
+        initSegment(tSeg);
+        initNode(tSeg->pNode);
+        tSeg->key = rand() % 20000;
+        tSeg->numberOfBlocks = 10+(rand()%20);
+        insertWithCoherency(tSeg);
+        if (0==(i%1000)) {
+            assert(wavlRankCheck(cacheMgmt.tavl.root));
+        }
+    }
+    tavlSanityCheck(&cacheMgmt.tavl);
+    assert(wavlRankCheck(cacheMgmt.tavl.root));
+
+    while (&cacheMgmt.lru.tail!=cacheMgmt.lru.head.next) {
+        before=tavlRotations;
+        freeNode(cacheMgmt.lru.head.next);
+        assert(tavlRotations-before<=2);
+        assert(wavlRankCheck(cacheMgmt.tavl.root));
+    }
+    assert(NULL==cacheMgmt.tavl.root);
+    setRankBalanced(&cacheMgmt.tavl, false);
+}
+
+/**
+ *  @brief  Checks the range occupancy and n-th block queries against a scan of the Thread
+ *  @param  None
+ *  @return None
+ */
+static void testOccupancy(void) {
+    segment_t *tSeg;
+    tavl_node_t *cNode;
+    unsigned i, j, lba, nb, end, cached, dirty, expCached, expDirty, total, rankLba;
+
+    printf("Testing range occupancy and n-th cached block queries\n");
+    for (i = 0; i < NUM_OF_SEGMENTS; i++) {
+        tSeg=popFromHead(&cacheMgmt.free);
+        initSegment(tSeg);
+        initNode(tSeg->pNode);
+        tSeg->key = rand() % 20000;
+        tSeg->numberOfBlocks = 10+(rand()%20);
+        insertWithCoherency(tSeg);
+        // Make every third one dirty.
+        if (0==(i%3)) {
+            moveToList(tSeg, &cacheMgmt.dirty);
+        }
+    }
+    tavlSanityCheck(&cacheMgmt.tavl);
+
+    for (i = 0; i < 1000; i++) {
+        lba = rand() % 20000;
+        nb = rand() % 2000;
+        tavlRangeCount(&cacheMgmt.tavl, lba, nb, &cached, &dirty);
+        // Count the same by walking the Thread.
+        expCached = 0;
+        expDirty = 0;
+        cNode = cacheMgmt.tavl.lowest.higher;
+        while (&cacheMgmt.tavl.highest!=cNode) {
+            end = MIN(lba+nb, cNode->pSeg->key+cNode->pSeg->numberOfBlocks);
+            if (end > MAX(lba, cNode->pSeg->key)) {
+                expCached += end - MAX(lba, cNode->pSeg->key);
+                if (&cacheMgmt.dirty==cNode->pSeg->pList) {
+                    expDirty += end - MAX(lba, cNode->pSeg->key);
+                }
+            }
+            cNode = cNode->higher;
+        }
+        assert(cached==expCached);
+        assert(dirty==expDirty);
+    }
+    // A window running past the last LBA is clamped rather than wrapped around.
+    lba = rand() % 10000;
+    tavlRangeCount(&cacheMgmt.tavl, lba, UINT_MAX-lba, &expCached, &expDirty);
+    tavlRangeCount(&cacheMgmt.tavl, lba, UINT_MAX, &cached, &dirty);
+    assert((cached==expCached)&&(dirty==expDirty)&&(0<cached));
+    // A segment ending at the top of the LBA space.
+    tSeg=popFromHead(&cacheMgmt.free);
+    initSegment(tSeg);
+    initNode(tSeg->pNode);
+    tSeg->key = UINT_MAX-9;
+    tSeg->numberOfBlocks = 10;
+    insertWithCoherency(tSeg);
+    moveToList(tSeg, &cacheMgmt.dirty);
+    tavlRangeCount(&cacheMgmt.tavl, UINT_MAX-9, 9, &cached, &dirty);
+    assert((9==cached)&&(9==dirty));
+    tavlRangeCount(&cacheMgmt.tavl, UINT_MAX-20, 15, &cached, &dirty);
+    assert((4==cached)&&(4==dirty));
+    freeNode(tSeg);
+
+    // Every cached block, in LBA order.
+    total = cacheMgmt.tavl.root->subtreeBlocks;
+    j = 0;
+    cNode = cacheMgmt.tavl.lowest.higher;
+    while (&cacheMgmt.tavl.highest!=cNode) {
+        for (lba = cNode->pSeg->key; lba < cNode->pSeg->key+cNode->pSeg->numberOfBlocks; lba++) {
+            assert(cNode==tavlSelectBlock(&cacheMgmt.tavl, j, &rankLba));
+            assert(lba==rankLba);
+            j++;
+        }
+        cNode = cNode->higher;
+    }
+    assert(j==total);
+    assert(NULL==tavlSelectBlock(&cacheMgmt.tavl, total, &rankLba));
+
+    while (&cacheMgmt.dirty.tail!=cacheMgmt.dirty.head.next) {
+        freeNode(cacheMgmt.dirty.head.next);
+        assert(tavlCountCheck(cacheMgmt.tavl.root));
+    }
+    tavlRangeCount(&cacheMgmt.tavl, 0, 30000, &cached, &dirty);
+    assert(0==dirty);
+    while (&cacheMgmt.lru.tail!=cacheMgmt.lru.head.next) {
+        freeNode(cacheMgmt.lru.head.next);
+    }
+    assert(NULL==cacheMgmt.tavl.root);
+}
+
+/**
+ *  @brief  Checks that partial invalidations, overwrites and destages of a segment
+ *          flip bits of its bitmaps without touching the tree,
+ *          and that lookups report hits at block granularity.
+ *  @param  None
+ *  @return None
+ */
+static void testBlockMaps(void) {
+    segment_t *smallSeg, *largeSeg;
+    tavl_node_t *smallNode;
+    uint64_t hitMap[4];
+    unsigned cached, dirty, lba, rotations;
+
+    printf("Testing sub-block validity and dirty bitmaps\n");
+    // A clean 29 block segment [1000..1029] and a clean 200 block one [2000..2200].
+    smallSeg=popFromHead(&cacheMgmt.free);
+    initSegment(smallSeg);
+    initNode(smallSeg->pNode);
+    smallSeg->key=1000;
+    smallSeg->numberOfBlocks=29;
+    insertWithCoherency(smallSeg);
+    largeSeg=popFromHead(&cacheMgmt.free);
+    initSegment(largeSeg);
+    initNode(largeSeg->pNode);
+    largeSeg->key=2000;
+    largeSeg->numberOfBlocks=200;
+    insertWithCoherency(largeSeg);
+    smallNode=(tavl_node_t *)(smallSeg->pNode);
+    rotations=tavlRotations;
+
+    // 1 block overwrite in the middle of the clean segment.
+    assert(markBlocksDirty(smallSeg, 1010, 1));
+    assert(smallSeg->pMap==smallSeg->inlineMap);
+    assert(&cacheMgmt.dirty==smallSeg->pList);
+    tavlRangeCount(&cacheMgmt.tavl, 1000, 29, &cached, &dirty);
+    assert((29==cached)&&(1==dirty));
+
+    // The first 2 blocks get invalidated.
+    assert(27==invalidateBlocks(smallSeg, 990, 12));
+    assert(27==invalidateBlocks(smallSeg, 1100, 10));
+    tavlRangeCount(&cacheMgmt.tavl, 0, 3000, &cached, &dirty);
+    assert((27+200==cached)&&(1==dirty));
+    assert(13==tavlLookupBlocks(&cacheMgmt.tavl, 995, 20, hitMap));
+    assert(0xfff80==hitMap[0]);
+    assert(NULL!=tavlSelectBlock(&cacheMgmt.tavl, 0, &lba));
+    assert(1002==lba);
+
+    // The write got to the media.
+    assert(cleanBlocks(smallSeg, 1010, 1));
+    assert(&cacheMgmt.lru==smallSeg->pList);
+    tavlRangeCount(&cacheMgmt.tavl, 0, 3000, &cached, &dirty);
+    assert(0==dirty);
+
+    // Large segments keep their bitmaps out of line.
+    assert(100==invalidateBlocks(largeSeg, 2050, 100));
+    assert((NULL!=largeSeg->pMap)&&(largeSeg->inlineMap!=largeSeg->pMap));
+    assert(markBlocksDirty(largeSeg, 2195, 10));
+    assert(&cacheMgmt.dirty==largeSeg->pList);
+    assert(27==tavlLookupBlocks(&cacheMgmt.tavl, 1000, 200, hitMap));
+    assert(100==tavlLookupBlocks(&cacheMgmt.tavl, 1990, 220, hitMap));
+    tavlRangeCount(&cacheMgmt.tavl, 2100, 100, &cached, &dirty);
+    assert((50==cached)&&(5==dirty));
+    assert(NULL!=tavlSelectBlock(&cacheMgmt.tavl, 27+50, &lba));
+    assert(2150==lba);
+
+    // Nothing above restructured the tree.
+    assert(tavlRotations==rotations);
+    assert(smallNode==smallSeg->pNode);
+    assert(2==cacheMgmt.tavl.active_nodes);
+    tavlSanityCheck(&cacheMgmt.tavl);
+
+    // Moving a segment with bitmaps between lists keeps its dirty bits in line with the list.
+    assert(markBlocksDirty(smallSeg, 1010, 2));
+    moveToList(smallSeg, &cacheMgmt.lru);
+    tavlRangeCount(&cacheMgmt.tavl, 1000, 29, &cached, &dirty);
+    assert((27==cached)&&(0==dirty));
+    moveToList(smallSeg, &cacheMgmt.dirty);
+    tavlRangeCount(&cacheMgmt.tavl, 1000, 29, &cached, &dirty);
+    assert((27==cached)&&(27==dirty));
+    assert(tavlCountCheck(cacheMgmt.tavl.root));
+
+    // Reclaim leaves a segment with dirty blocks alone, even one that made it to the LRU list.
+    removeFromList(largeSeg);
+    pushToTail(largeSeg, &cacheMgmt.lru);
+    setWatermarks(NUM_OF_SEGMENTS, NUM_OF_SEGMENTS);
+    assert(0==reclaimCache(NUM_OF_SEGMENTS));
+    assert(&cacheMgmt.lru==largeSeg->pList);
+    setWatermarks(0, 0);
+    removeFromList(largeSeg);
+    pushToTail(largeSeg, &cacheMgmt.dirty);
+
+    // Invalidating the last valid blocks frees the segment.
+    assert(0==invalidateBlocks(smallSeg, 1000, 29));
+    assert(&cacheMgmt.free==smallSeg->pList);
+    assert(NULL==smallSeg->pMap);
+    assert(50==invalidateBlocks(largeSeg, 2000, 50));
+    assert(0==invalidateBlocks(largeSeg, 2150, 50));
+    assert(NULL==largeSeg->pMap);
+    assert(NULL==cacheMgmt.tavl.root);
+}
+
+/**
+ *  @brief  Checks that writes landing in a dirty segment are absorbed in place,
+ *          and that the rest of a write goes through invalidation and insertion.
+ *          Pinned segments keep their extent, and are not reused till unpinned once dropped from the tree.
+ *          Writes at the top of the LBA space do not wrap around.
+ *  @param  None
+ *  @return None
+ */
+static void testWriteAbsorb(void) {
+    segment_t *tSeg, *otherSeg, *pinnedSeg;
+    tavl_node_t *tNode;
+    segList_t held;
+    uint64_t hitMap[1];
+    unsigned i, cached, dirty, rotations;
+
+    printf("Testing in-place write absorption\n");
+    assert(writeToCache(1000, 29));
+    assert(writeToCache(2000, 10));
+    tSeg=((tavl_node_t *)(searchTavl(cacheMgmt.tavl.root, 1000)))->pSeg;
+    otherSeg=((tavl_node_t *)(searchTavl(cacheMgmt.tavl.root, 2000)))->pSeg;
+    assert((1000==tSeg->key)&&(&cacheMgmt.dirty==tSeg->pList));
+    assert(cacheMgmt.dirty.tail.prev==otherSeg);
+    tNode=(tavl_node_t *)(tSeg->pNode);
+    rotations=tavlRotations;
+
+    // Hot block rewrites within the segment. No tree operation at all.
+    for (i = 0; i < 100; i++) {
+        assert(writeToCache(1000+(rand()%25), 4));
+        assert(cacheMgmt.dirty.tail.prev==tSeg);
+    }
+    assert(tavlRotations==rotations);
+    assert(tNode==tSeg->pNode);
+    assert(NULL==tSeg->pMap);
+    assert(2==cacheMgmt.tavl.active_nodes);
+
+    // Prefix overlap - the first 9 blocks are absorbed, the rest becomes a new segment.
+    assert(9==absorbWrite(1020, 20));
+    assert(writeToCache(1020, 20));
+    assert(3==cacheMgmt.tavl.active_nodes);
+    tavlRangeCount(&cacheMgmt.tavl, 1000, 40, &cached, &dirty);
+    assert((40==cached)&&(40==dirty));
+
+    // A partially invalidated dirty segment absorbs a write into its hole and gets the blocks back.
+    assert(27==invalidateBlocks(tSeg, 1010, 2));
+    assert(10==tavlLookupBlocks(&cacheMgmt.tavl, 1000, 12, hitMap));
+    assert(0x3ff==hitMap[0]);
+    assert(2==absorbWrite(1010, 2));
+    assert(12==tavlLookupBlocks(&cacheMgmt.tavl, 1000, 12, hitMap));
+    assert(tNode==tSeg->pNode);
+
+    // A clean segment takes an overwrite within it in place.
+    assert(cleanBlocks(tSeg, 1000, 29));
+    assert(&cacheMgmt.lru==tSeg->pList);
+    assert(0==absorbWrite(1003, 3));
+    assert(writeToCache(1003, 3));
+    assert(&cacheMgmt.dirty==tSeg->pList);
+    assert(tNode==tSeg->pNode);
+    tavlRangeCount(&cacheMgmt.tavl, 1000, 29, &cached, &dirty);
+    assert((29==cached)&&(3==dirty));
+
+    // A pinned segment, being written to the media, does not absorb, and keeps its extent.
+    // A write cutting it in parts waits till it is unpinned.
+    otherSeg->refCount++;
+    assert(0==absorbWrite(2000, 5));
+    assert(false==writeToCache(2000, 5));
+    assert(false==writeToCache(1995, 10));
+    assert((2000==otherSeg->key)&&(10==otherSeg->numberOfBlocks));
+    assert(3==cacheMgmt.tavl.active_nodes);
+    // An invalidation of its start punches a hole instead of shrinking it.
+    assert(5==invalidateBlocks(otherSeg, 1995, 10));
+    assert((2000==otherSeg->key)&&(10==otherSeg->numberOfBlocks));
+    tavlRangeCount(&cacheMgmt.tavl, 2000, 10, &cached, &dirty);
+    assert((5==cached)&&(5==dirty));
+    otherSeg->refCount--;
+    assert(writeToCache(2000, 5));
+    assert((2000==otherSeg->key)&&(10==otherSeg->numberOfBlocks));
+    tavlRangeCount(&cacheMgmt.tavl, 2000, 10, &cached, &dirty);
+    assert((10==cached)&&(10==dirty));
+
+    // A write into the middle of a pinned, partly dirty segment. The write fails rather than drop the dirty blocks.
+    assert(writeToCache(2200, 100));
+    assert(cleanRange(2200, 50));
+    pinnedSeg=((tavl_node_t *)(searchTavl(cacheMgmt.tavl.root, 2200)))->pSeg;
+    pinnedSeg->refCount++;
+    assert(false==writeToCache(2240, 20));
+    assert((2200==pinnedSeg->key)&&(100==pinnedSeg->numberOfBlocks)&&(&cacheMgmt.dirty==pinnedSeg->pList));
+    tavlRangeCount(&cacheMgmt.tavl, 2200, 100, &cached, &dirty);
+    assert((100==cached)&&(50==dirty));
+
+    // A write covering it, with the free list empty. The pinned segment leaves the tree, but must not
+    // come back as the segment of the write, while the destage still holds it.
+    assert(writeToCache(2500, 10));
+    assert(cleanRange(2500, 10));
+    initSegment(&held.head);
+    initSegment(&held.tail);
+    held.head.next=&held.tail;
+    held.tail.prev=&held.head;
+    held.count=0;
+    while (NULL!=(tSeg=popFromHead(&cacheMgmt.free))) {
+        pushToTail(tSeg, &held);
+    }
+    assert(writeToCache(2190, 120));
+    otherSeg=((tavl_node_t *)(searchTavl(cacheMgmt.tavl.root, 2240)))->pSeg;
+    assert((otherSeg!=pinnedSeg)&&(2190==otherSeg->key)&&(120==otherSeg->numberOfBlocks));
+    assert((&cacheMgmt.stale==pinnedSeg->pList)&&(1==pinnedSeg->refCount));
+    assert(NULL==searchAvl(cacheMgmt.tavl.root, 2200));
+    // The destage completes on a segment no longer in the tree, and lets it go.
+    assert(cleanBlocks(pinnedSeg, 2200, 100));
+    assert(0==invalidateBlocks(pinnedSeg, 2200, 100));
+    pinnedSeg->refCount--;
+    assert(pinnedSeg==allocSegment());
+    pushToTail(pinnedSeg, &cacheMgmt.free);
+    while (NULL!=(tSeg=popFromHead(&held))) {
+        pushToTail(tSeg, &cacheMgmt.free);
+    }
+
+    // The same with an invalidation covering a pinned segment.
+    otherSeg->refCount++;
+    assert(invalidateRange(2190, 120));
+    assert((&cacheMgmt.stale==otherSeg->pList)&&(NULL==searchAvl(cacheMgmt.tavl.root, 2190)));
+    otherSeg->refCount--;
+    assert(0==reclaimCache(0));
+    assert((&cacheMgmt.free==otherSeg->pList)&&(0==cacheMgmt.stale.count));
+
+    // Writes ending at the top of the LBA space, or past it.
+    assert(writeToCache(100, 10));
+    assert(writeToCache(UINT_MAX-9, 10));
+    tSeg=((tavl_node_t *)(searchTavl(cacheMgmt.tavl.root, UINT_MAX)))->pSeg;
+    assert((UINT_MAX-9==tSeg->key)&&(10==tSeg->numberOfBlocks));
+    assert(10==tavlLookupBlocks(&cacheMgmt.tavl, UINT_MAX-9, 10, hitMap));
+    assert(cleanRange(UINT_MAX-4, 5));
+    tavlRangeCount(&cacheMgmt.tavl, UINT_MAX-9, 9, &cached, &dirty);
+    assert((9==cached)&&(5==dirty));
+    // Only the blocks up to UINT_MAX are taken.
+    assert(writeToCache(UINT_MAX-7, 20));
+    assert((UINT_MAX-9==tSeg->key)&&(10==tSeg->numberOfBlocks));
+    tavlRangeCount(&cacheMgmt.tavl, UINT_MAX-9, 9, &cached, &dirty);
+    assert((9==cached)&&(9==dirty));
+    assert(cleanRange(UINT_MAX-9, 10));
+    assert(&cacheMgmt.lru==tSeg->pList);
+    assert(8==invalidateBlocks(tSeg, UINT_MAX-1, 10));
+    assert((UINT_MAX-9==tSeg->key)&&(8==tSeg->numberOfBlocks));
+    assert(0==invalidateBlocks(tSeg, UINT_MAX-9, 10));
+    assert(NULL==searchAvl(cacheMgmt.tavl.root, UINT_MAX-9));
+    assert(invalidateRange(100, 10));
+
+    tavlSanityCheck(&cacheMgmt.tavl);
+    assert(tavlHeightCheck(cacheMgmt.tavl.root));
+    invalidateRange(0, 3000);
+    assert(NULL==cacheMgmt.tavl.root);
+    assert(0==cacheMgmt.dirty.count);
+
+    // Random writes, invalidations and destages.
+    for (i = 0; i < TEST_LOOP/10; i++) {
+        switch (rand()%4) {
+        case 0:
+            invalidateRange(rand()%20000, 1+(rand()%100));
+            break;
+        case 1:
+            // Destage the oldest dirty segment, or a part of it.
+            if (0!=cacheMgmt.dirty.count) {
+                tSeg=cacheMgmt.dirty.head.next;
+                assert(cleanBlocks(tSeg, tSeg->key+(rand()%tSeg->numberOfBlocks), 1+(rand()%100)));
+            }
+            break;
+        default:
+            while (false==writeToCache(rand()%20000, 1+(rand()%100))) {
+                // Everything is dirty. Destage before retrying.
+                tSeg=cacheMgmt.dirty.head.next;
+                assert(cleanBlocks(tSeg, 0, UINT_MAX/2));
+            }
+            break;
+        }
+        if (0==(i%10000)) {
+            tavlSanityCheck(&cacheMgmt.tavl);
+        }
+    }
+    tavlSanityCheck(&cacheMgmt.tavl);
+    assert(tavlHeightCheck(cacheMgmt.tavl.root));
+    invalidateRange(0, 30000);
+    assert(NULL==cacheMgmt.tavl.root);
+    assert(NUM_OF_SEGMENTS==cacheMgmt.free.count);
+}
+
+/**
+ *  @brief  Checks the Thread order and the bucket trees of the given radix-directed tree,
+ *          and that searchRtavl() finds what a walk of the Thread finds
+ *  @param  rtavl_t *pRtavl - the tree
+ *  @return None
+ */
+static void checkRadix(rtavl_t *pRtavl) {
+    tavl_node_t *tNode, *expected;
+    unsigned lba, b, count = 0;
+
+    // Thread in order, and every bucket holds a balanced tree of its own LBAs.
+    for (tNode = pRtavl->tavl.lowest.higher; &pRtavl->tavl.highest != tNode; tNode = tNode->higher) {
+        assert((&pRtavl->tavl.lowest == tNode->lower) || (tNode->lower->pSeg->key < tNode->pSeg->key));
+        count++;
+    }
+    assert((unsigned)pRtavl->tavl.active_nodes == count);
+    for (b = 0; b < pRtavl->numOfBuckets; b++) {
+        assert(tavlHeightCheck(pRtavl->bucket[b]));
+    }
+    for (lba = 0; lba < 20000; lba += 7) {
+        expected = &pRtavl->tavl.lowest;
+        while ((&pRtavl->tavl.highest != expected->higher) && (expected->higher->pSeg->key <= lba)) {
+            expected = expected->higher;
+        }
+        assert(searchRtavl(pRtavl, lba) == expected);
+    }
+}
+
+/**
+ *  @brief  Inserts and removes random keys in a radix-directed tree of 16 buckets,
+ *          checking it against its Thread along the way, then empties it
+ *  @param  None
+ *  @return None
+ */
+static void testRadix(void) {
+    rtavl_t radix;
+    segment_t segs[NUM_OF_SEGMENTS], *tSeg;
+    tavl_node_t nodes[NUM_OF_SEGMENTS], *tNode;
+    segList_t spare;
+    unsigned i, key;
+
+    printf("Testing the radix-directed tree\n");
+    // The index is standalone. It gets segments and nodes of its own, not from the cache pool.
+    initSegment(&spare.head);
+    initSegment(&spare.tail);
+    spare.head.next=&spare.tail;
+    spare.tail.prev=&spare.head;
+    spare.count=0;
+    for (i = 0; i < NUM_OF_SEGMENTS; i++) {
+        initSegment(&segs[i]);
+        segs[i].pNode=(void *)&nodes[i];
+        nodes[i].pSeg=&segs[i];
+        pushToTail(&segs[i], &spare);
+    }
+    // 16 buckets of 1024 LBAs. LBAs beyond go to the last bucket.
+    assert(initRtavl(&radix, 10, 16));
+    assert(&radix.tavl.lowest == searchRtavl(&radix, 5000));
+    for (i = 0; i < TEST_LOOP/10; i++) {
+        key = rand() % 20000;
+        tNode = searchRtavl(&radix, key);
+        if ((&radix.tavl.lowest != tNode) && (tNode->pSeg->key == key)) {
+            // Remove an existing key. Otherwise insert it, or remove the node below it when the pool is out.
+            tSeg = tNode->pSeg;
+            removeFromRtavl(&radix, tSeg);
+            pushToTail(tSeg, &spare);
+        } else if (NULL != (tSeg = popFromHead(&spare))) {
+            initSegment(tSeg);
+            initNode(tSeg->pNode);
+            tSeg->key = key;
+            tSeg->numberOfBlocks = 1;
+            insertToRtavl(&radix, (tavl_node_t *)(tSeg->pNode));
+        } else {
+            tNode = (&radix.tavl.lowest == tNode) ? radix.tavl.lowest.higher : tNode;
+            tSeg = tNode->pSeg;
+            removeFromRtavl(&radix, tSeg);
+            pushToTail(tSeg, &spare);
+        }
+        if (0 == (i % 10000)) {
+            checkRadix(&radix);
+        }
+    }
+    checkRadix(&radix);
+
+    // Empty it from the lowest.
+    while (&radix.tavl.highest != radix.tavl.lowest.higher) {
+        tSeg = radix.tavl.lowest.higher->pSeg;
+        removeFromRtavl(&radix, tSeg);
+        pushToTail(tSeg, &spare);
+    }
+    for (i = 0; i < radix.numOfBuckets; i++) {
+        assert(NULL == radix.bucket[i]);
+    }
+    freeRtavl(&radix);
+    assert(NUM_OF_SEGMENTS==spare.count);
+}
+
+static journal_t        testJournalLog;
+static pthread_mutex_t  cacheLock = PTHREAD_MUTEX_INITIALIZER;
+static bool             dirtyBefore[JOURNAL_LBAS];
+static pthread_barrier_t journalRound;
+
+/**
+ *  @brief  Writes to the cache and journals it. Destages the oldest dirty segment if everything is dirty.
+ *          Call under cacheLock.
+ *  @param  unsigned lba - first LBA, unsigned numberOfBlocks - number of blocks
+ *  @return Sequence number of the last record appended
+ */
+static uint64_t journaledWrite(unsigned lba, unsigned numberOfBlocks) {
+    segment_t *tSeg;
+    uint64_t seq;
+
+    while (false==writeToCache(lba, numberOfBlocks)) {
+        tSeg=cacheMgmt.dirty.head.next;
+        (void)journalAppend(&testJournalLog, JOURNAL_CLEAN, tSeg->key, tSeg->numberOfBlocks);
+        assert(cleanBlocks(tSeg, 0, UINT_MAX/2));
+    }
+    seq = journalAppend(&testJournalLog, JOURNAL_DIRTY, lba, numberOfBlocks);
+    assert(0!=seq);
+    return seq;
+}
+
+/**
+ *  @brief  Tells whether the given LBA is a dirty block in the cache
+ *  @param  unsigned lba - the LBA
+ *  @return bool - true if dirty
+ */
+static bool dirtyAt(unsigned lba) {
+    unsigned cached, dirty;
+
+    tavlRangeCount(&cacheMgmt.tavl, lba, 1, &cached, &dirty);
+    return (0!=dirty);
+}
+
+/**
+ *  @brief  A writer thread. Updates the cache under the lock, and commits outside of it.
+ *          Writers commit in rounds, once all of them have appended, so that each round is a group.
+ *  @param  void *arg - not used
+ *  @return NULL
+ */
+static void *journalWriter(void *arg) {
+    uint64_t seq;
+    unsigned i;
+
+    (void)arg;
+    for (i = 0; i < 1000; i++) {
+        pthread_mutex_lock(&cacheLock);
+        seq = journaledWrite(rand()%20000, 1+(rand()%100));
+        pthread_mutex_unlock(&cacheLock);
+        (void)pthread_barrier_wait(&journalRound);
+        assert(journalCommit(&testJournalLog, seq));
+    }
+    return NULL;
+}
+
+/**
+ *  @brief  Checks that the journal brings back the dirty set after a crash, from the log as well as
+ *          from a checkpoint, that a torn tail is dropped, and that concurrent commits share batches.
+ *  @param  None
+ *  @return None
+ */
+static void testJournal(void) {
+    pthread_t threads[JOURNAL_THREADS];
+    poolChunk_t *pChunk;
+    unsigned i, lba, numOfRecords, numberOfBlocks;
+    uint64_t seq = 0;
+    FILE *fp;
+
+    printf("Testing the dirty set journal\n");
+    (void)unlink(JOURNAL_PATH);
+    assert(replayJournal(JOURNAL_PATH, &numOfRecords) && (0==numOfRecords));
+    assert(openJournal(&testJournalLog, JOURNAL_PATH));
+    testJournalLog.checkpointBytes = 64*1024;
+
+    // Single writer with writes, trims and destages, checkpointing as the log grows.
+    for (i = 0; i < TEST_LOOP/10; i++) {
+        lba = rand()%20000;
+        numberOfBlocks = 1+(rand()%100);
+        switch (rand()%4) {
+        case 0:
+            invalidateRange(lba, numberOfBlocks);
+            seq = journalAppend(&testJournalLog, JOURNAL_TRIM, lba, numberOfBlocks);
+            break;
+        case 1:
+            assert(cleanRange(lba, numberOfBlocks));
+            seq = journalAppend(&testJournalLog, JOURNAL_CLEAN, lba, numberOfBlocks);
+            break;
+        default:
+            seq = journaledWrite(lba, numberOfBlocks);
+            break;
+        }
+        if (0==(i%16)) {
+            assert(journalCommit(&testJournalLog, seq));
+        }
+        if (journalCheckpointDue(&testJournalLog)) {
+            assert(journalCheckpoint(&testJournalLog));
+        }
+    }
+    assert(journalCommit(&testJournalLog, seq));
+
+    // Concurrent writers share the fdatasync calls. The first committer of a round writes the records of all.
+    testJournalLog.batches = 0;
+    assert(0==pthread_barrier_init(&journalRound, NULL, JOURNAL_THREADS));
+    for (i = 0; i < JOURNAL_THREADS; i++) {
+        assert(0==pthread_create(&threads[i], NULL, journalWriter, NULL));
+    }
+    for (i = 0; i < JOURNAL_THREADS; i++) {
+        assert(0==pthread_join(threads[i], NULL));
+    }
+    assert(0==pthread_barrier_destroy(&journalRound));
+    printf("%d commits in %lu batches\n", JOURNAL_THREADS*1000, testJournalLog.batches);
+    assert(testJournalLog.batches < JOURNAL_THREADS*1000);
+    assert(closeJournal(&testJournalLog));
+    tavlSanityCheck(&cacheMgmt.tavl);
+
+    // Crash. Only the dirty blocks have to come back.
+    for (lba = 0; lba < JOURNAL_LBAS; lba++) {
+        dirtyBefore[lba] = dirtyAt(lba);
+    }
+    invalidateRange(0, 30000);
+    assert(NULL==cacheMgmt.tavl.root);
+    assert(replayJournal(JOURNAL_PATH, &numOfRecords) && (0<numOfRecords));
+    for (lba = 0; lba < JOURNAL_LBAS; lba++) {
+        assert(dirtyBefore[lba]==dirtyAt(lba));
+    }
+    tavlSanityCheck(&cacheMgmt.tavl);
+
+    // A torn record at the tail is dropped.
+    fp = fopen(JOURNAL_PATH, "ab");
+    assert(NULL!=fp);
+    assert(6==fwrite("\x01\x00\x00\x00\x10\x00", 1, 6, fp));
+    fclose(fp);
+    invalidateRange(0, 30000);
+    assert(replayJournal(JOURNAL_PATH, &i) && (numOfRecords==i));
+    for (lba = 0; lba < JOURNAL_LBAS; lba++) {
+        assert(dirtyBefore[lba]==dirtyAt(lba));
+    }
+    fp = fopen(JOURNAL_PATH, "rb");
+    assert(NULL!=fp);
+    assert(0==fseek(fp, 0, SEEK_END));
+    assert(sizeof(journalRecord_t)*numOfRecords==(unsigned long)ftell(fp));
+    fclose(fp);
+
+    // A checkpoint keeps the dirty set only, up to the top of the LBA space. The replayed dirty set fills the pool.
+    assert(NULL!=growCache(1));
+    assert(writeToCache(UINT_MAX-9, 10));
+    assert(cleanRange(UINT_MAX-4, 5));
+    assert(openJournal(&testJournalLog, JOURNAL_PATH));
+    assert(journalCheckpoint(&testJournalLog));
+    assert(closeJournal(&testJournalLog));
+    invalidateRange(0, 30000);
+    assert(0==invalidateBlocks(((tavl_node_t *)(searchTavl(cacheMgmt.tavl.root, UINT_MAX)))->pSeg, UINT_MAX-9, 10));
+    assert(replayJournal(JOURNAL_PATH, &i) && (i<numOfRecords));
+    for (lba = 0; lba < JOURNAL_LBAS; lba++) {
+        assert(dirtyBefore[lba]==dirtyAt(lba));
+    }
+    tavlRangeCount(&cacheMgmt.tavl, UINT_MAX-9, 9, &lba, &numberOfBlocks);
+    assert((9==lba)&&(5==numberOfBlocks));
+    assert(0==invalidateBlocks(((tavl_node_t *)(searchTavl(cacheMgmt.tavl.root, UINT_MAX)))->pSeg, UINT_MAX-9, 10));
+
+    invalidateRange(0, 30000);
+    assert(NULL==cacheMgmt.tavl.root);
+    // Give back what replay had to grow.
+    while (NULL!=cacheMgmt.chunks->next) {
+        pChunk=cacheMgmt.chunks->next;
+        shrinkCache(pChunk);
+        assert(drainChunk(pChunk, UINT_MAX));
+    }
+    assert(NUM_OF_SEGMENTS==cacheMgmt.free.count);
+    assert(0==unlink(JOURNAL_PATH));
+}
+
+static mq_t             testMq;
+
+/**
+ *  @brief  Checks a completion of the command sequence of mqSubmitter()
+ *  @param  mqCommand_t *pCompletion - the completion
+ *          unsigned *pExpected - tag of the next completion, bool *pWritten - whether the last write succeeded
+ *  @return None
+ */
+static void checkCompletion(mqCommand_t *pCompletion, unsigned *pExpected, bool *pWritten) {
+    unsigned tag = (unsigned)(uintptr_t)(pCompletion->tag);
+
+    // Completions come in submission order.
+    assert(*pExpected == tag);
+    (*pExpected)++;
+    switch (tag % 5) {
+    case 0:
+        *pWritten = (1 == pCompletion->result);
+        break;
+    case 1:
+        // The read went after the write.
+        assert((false == *pWritten) || (pCompletion->numberOfBlocks == pCompletion->result));
+        break;
+    case 4:
+        // The read went after the invalidation.
+        assert(0 == pCompletion->result);
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ *  @brief  A submitter thread with its own queue and its own LBA range
+ *  @param  void *arg - queue index
+ *  @return NULL
+ */
+static void *mqSubmitter(void *arg) {
+    unsigned queue = (unsigned)(uintptr_t)arg;
+    unsigned seed = queue;
+    mqCommand_t commands[5], completions[MQ_DEPTH];
+    unsigned i, j, n, submitted, lba, numberOfBlocks, expected = 0;
+    bool written = false;
+
+    for (i = 0; i < 2000; i++) {
+        // Write, read back, destage, invalidate and read again. Same LBAs, one queue.
+        lba = queue*5000 + rand_r(&seed)%4900;
+        numberOfBlocks = 1 + rand_r(&seed)%100;
+        commands[0] = (mqCommand_t){MQ_WRITE, lba, numberOfBlocks, 0, (void *)(uintptr_t)(5*i)};
+        commands[1] = (mqCommand_t){MQ_READ, lba, numberOfBlocks, 0, (void *)(uintptr_t)(5*i+1)};
+        commands[2] = (mqCommand_t){MQ_CLEAN, lba, numberOfBlocks, 0, (void *)(uintptr_t)(5*i+2)};
+        commands[3] = (mqCommand_t){MQ_INVALIDATE, lba, numberOfBlocks, 0, (void *)(uintptr_t)(5*i+3)};
+        commands[4] = (mqCommand_t){MQ_READ, lba, numberOfBlocks, 0, (void *)(uintptr_t)(5*i+4)};
+        for (submitted = 0; submitted < 5; ) {
+            submitted += mqSubmit(&testMq, queue, &commands[submitted], 5 - submitted);
+            n = mqReap(&testMq, queue, completions, MQ_DEPTH);
+            for (j = 0; j < n; j++) {
+                checkCompletion(&completions[j], &expected, &written);
+            }
+            if ((submitted < 5) && (0 == n)) {
+                // The queue is full. Give the worker the core, in case there are not enough of them.
+                sched_yield();
+            }
+        }
+    }
+    while (expected < 5*2000) {
+        n = mqReap(&testMq, queue, completions, MQ_DEPTH);
+        for (j = 0; j < n; j++) {
+            checkCompletion(&completions[j], &expected, &written);
+        }
+        if (0 == n) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+/**
+ *  @brief  Checks the multi-queue front end with concurrent submitters, each checking the order of its
+ *          own completions, a submitter that stops reaping, and polled mode.
+ *  @param  None
+ *  @return None
+ */
+static void testMultiQueue(void) {
+    pthread_t threads[MQ_THREADS];
+    mqCommand_t commands[MQ_DEPTH+1], completions[MQ_DEPTH];
+    unsigned i, j;
+
+    printf("Testing the multi-queue front end\n");
+    assert(mqInit(&testMq, MQ_THREADS, MQ_DEPTH, false));
+    for (i = 0; i < MQ_THREADS; i++) {
+        assert(0==pthread_create(&threads[i], NULL, mqSubmitter, (void *)(uintptr_t)i));
+    }
+    for (i = 0; i < MQ_THREADS; i++) {
+        assert(0==pthread_join(threads[i], NULL));
+    }
+    mqShutdown(&testMq);
+    printf("%lu commands in %lu batches\n", testMq.commands, testMq.batches);
+    assert(MQ_THREADS*5*2000==testMq.commands);
+    tavlSanityCheck(&cacheMgmt.tavl);
+    assert(0==cacheMgmt.dirty.count);
+
+    // A submitter that stops reaping. With its completion ring full, the worker sleeps rather than
+    // spinning on commands it cannot complete, and the next reap wakes it up.
+    assert(mqInit(&testMq, 1, MQ_DEPTH, false));
+    for (i = 0; i < MQ_DEPTH; i++) {
+        commands[i] = (mqCommand_t){MQ_READ, i*100, 50, 0, (void *)(uintptr_t)i};
+    }
+    assert(MQ_DEPTH==mqSubmit(&testMq, 0, commands, MQ_DEPTH));
+    while (MQ_DEPTH!=atomic_load(&testMq.pQueues[0].cqTail)) {
+        sched_yield();
+    }
+    assert(MQ_DEPTH==mqSubmit(&testMq, 0, commands, MQ_DEPTH));
+    // Asleep for good, not just between two spins.
+    for (i = 0, j = 0; j < 100; i++) {
+        assert(i<1000000);
+        j = atomic_load(&testMq.sleeping) ? j+1 : 0;
+        sched_yield();
+    }
+    assert(MQ_DEPTH==mqReap(&testMq, 0, completions, MQ_DEPTH));
+    while (2*MQ_DEPTH!=atomic_load(&testMq.pQueues[0].cqTail)) {
+        sched_yield();
+    }
+    assert(MQ_DEPTH==mqReap(&testMq, 0, completions, MQ_DEPTH));
+    mqShutdown(&testMq);
+
+    // Polled - nothing runs until the owner of the cache polls, and a full queue refuses more.
+    assert(mqInit(&testMq, 1, MQ_DEPTH, true));
+    for (i = 0; i < MQ_DEPTH+1; i++) {
+        commands[i] = (mqCommand_t){MQ_WRITE, i*100, 50, 0, (void *)(uintptr_t)i};
+    }
+    assert(MQ_DEPTH==mqSubmit(&testMq, 0, commands, MQ_DEPTH+1));
+    assert(0==mqReap(&testMq, 0, completions, MQ_DEPTH));
+    assert(NULL==cacheMgmt.tavl.root);
+    assert(MQ_DEPTH==mqPoll(&testMq));
+    assert(1==testMq.batches);
+    assert(MQ_DEPTH==mqReap(&testMq, 0, completions, MQ_DEPTH));
+    for (i = 0; i < MQ_DEPTH; i++) {
+        assert((i==(unsigned)(uintptr_t)(completions[i].tag))&&(1==completions[i].result));
+    }
+    assert(MQ_DEPTH==cacheMgmt.dirty.count);
+    mqShutdown(&testMq);
+
+    invalidateRange(0, 30000);
+    assert(NULL==cacheMgmt.tavl.root);
+    assert(NUM_OF_SEGMENTS==cacheMgmt.free.count);
+}
+
+/**
+ *  @brief  Grows the pool with a chunk of each page size, bound to NUMA node 0, and checks that the chunk
+ *          gets the requested pages or smaller ones, and that its segments work as any other.
+ *  @param  None
+ *  @return None
+ */
+static void testPoolPlacement(void) {
+    static const unsigned pageSizes[] = {POOL_PAGE_SMALL, POOL_PAGE_THP, POOL_PAGE_2M, POOL_PAGE_1G};
+    static const char *names[] = {"malloc", "small", "THP", "2M", "1G"};
+    poolChunk_t *pChunk;
+    unsigned i, j;
+
+    printf("Testing pool placement\n");
+    for (i = 0; i < sizeof(pageSizes)/sizeof(pageSizes[0]); i++) {
+        setPoolPlacement(pageSizes[i], true, 0);
+        pChunk = growCache(3000);
+        assert(NULL!=pChunk);
+        printf("%s pages requested. Segments got %s pages%s, nodes got %s pages%s\n", names[pageSizes[i]],
+            names[pChunk->segmentsMapping.pageSize], pChunk->segmentsMapping.bound ? " on node 0" : "",
+            names[pChunk->nodesMapping.pageSize], pChunk->nodesMapping.bound ? " on node 0" : "");
+        // Smaller pages if the requested ones are not available, never larger ones.
+        assert(pChunk->segmentsMapping.pageSize<=pageSizes[i]);
+        assert(pChunk->nodesMapping.pageSize<=pageSizes[i]);
+#ifdef __linux__
+        assert(POOL_PAGE_DEFAULT!=pChunk->segmentsMapping.pageSize);
+#endif
+
+        // Segments of the new chunk go through the tree like any other.
+        for (j = 0; j < 3000; j++) {
+            assert(writeToCache(j*10, 5));
+        }
+        assert(3000==cacheMgmt.dirty.count);
+        assert(tavlHeightCheck(cacheMgmt.tavl.root));
+        invalidateRange(0, 30000);
+        shrinkCache(pChunk);
+        assert(drainChunk(pChunk, UINT_MAX));
+    }
+    setPoolPlacement(POOL_PAGE_DEFAULT, false, 0);
+    assert(NUM_OF_SEGMENTS==cacheMgmt.free.count);
+}
+
+/**
+ *  @brief  Checks full and range scans of the cursor against a walk of the Thread,
+ *          that segments invalidated or trimmed during a scan do not derail it, and scans at the top of the LBA space.
+ *  @param  None
+ *  @return None
+ */
+static void testScanCursor(void) {
+    tavlScanEntry_t entries[7];
+    tavlCursor_t cursor;
+    tavl_node_t *tNode;
+    unsigned i, n, end, visited;
+
+    printf("Testing the Thread scan cursor\n");
+    for (i = 0; i < NUM_OF_SEGMENTS; i++) {
+        assert(writeToCache(i*200 + rand()%50, 1+(rand()%100)));
+    }
+    for (i = 0; i < NUM_OF_SEGMENTS; i += 3) {
+        assert(cleanRange(i*200, 200));
+    }
+
+    // A full scan gives the Thread, batch by batch.
+    tavlCursorInit(&cursor, &cacheMgmt.tavl, 0, UINT_MAX);
+    tNode = cacheMgmt.tavl.lowest.higher;
+    visited = 0;
+    while (0 < (n = tavlCursorNext(&cursor, entries, 7))) {
+        for (i = 0; i < n; i++) {
+            assert(tNode->pSeg==entries[i].pSeg);
+            assert((tNode->pSeg->key==entries[i].key)&&(tNode->pSeg->numberOfBlocks==entries[i].numberOfBlocks));
+            assert(((&cacheMgmt.dirty==tNode->pSeg->pList) ? BLOCK_DIRTY : BLOCK_CLEAN)==entries[i].state);
+            tNode = tNode->higher;
+            visited++;
+        }
+    }
+    assert((&cacheMgmt.tavl.highest==tNode)&&(NUM_OF_SEGMENTS==visited));
+    assert(0==tavlCursorNext(&cursor, entries, 7));
+
+    // A scan from the middle to the end, with the end clamped rather than wrapped around.
+    tavlCursorInit(&cursor, &cacheMgmt.tavl, 5030, UINT_MAX);
+    assert(0<tavlCursorNext(&cursor, entries, 7));
+
+    // A range scan starts with the segment reaching its first LBA, and stops before its end.
+    tavlCursorInit(&cursor, &cacheMgmt.tavl, 5030, 3000);
+    n = tavlCursorNext(&cursor, entries, 7);
+    assert((0<n)&&(entries[0].key+entries[0].numberOfBlocks>5030)&&(entries[0].key<5250));
+    tNode = (tavl_node_t *)(entries[0].pSeg->pNode);
+    assert((&cacheMgmt.tavl.lowest==tNode->lower)||(tNode->lower->pSeg->key+tNode->lower->pSeg->numberOfBlocks<=5030));
+    visited = n;
+    while (0 < (n = tavlCursorNext(&cursor, entries, 7))) {
+        assert(entries[n-1].key<8030);
+        visited += n;
+    }
+    for (n = 0; (&cacheMgmt.tavl.highest!=tNode)&&(tNode->pSeg->key<8030); tNode = tNode->higher) {
+        n++;
+    }
+    assert(n==visited);
+
+    // Invalidations during the scan. Every other segment goes, the others lose their first block.
+    tavlCursorInit(&cursor, &cacheMgmt.tavl, 0, UINT_MAX);
+    end = 0;
+    visited = 0;
+    while (0 < (n = tavlCursorNext(&cursor, entries, 5))) {
+        for (i = 0; i < n; i++) {
+            assert(entries[i].key>=end);
+            end = entries[i].key + entries[i].numberOfBlocks;
+            if (0==(visited%2)) {
+                invalidateRange(entries[i].key, entries[i].numberOfBlocks);
+            } else {
+                assert(entries[i].numberOfBlocks-1==invalidateBlocks(entries[i].pSeg, entries[i].key, 1));
+            }
+            visited++;
+        }
+    }
+    assert(NUM_OF_SEGMENTS==visited);
+    assert(NUM_OF_SEGMENTS/2>=cacheMgmt.tavl.active_nodes);
+    tavlSanityCheck(&cacheMgmt.tavl);
+
+    // Segments at the top of the LBA space. The last one ends at 2^32, which wraps around to 0.
+    assert(writeToCache(UINT_MAX-19, 10));
+    assert(writeToCache(UINT_MAX-9, 10));
+    tavlCursorInit(&cursor, &cacheMgmt.tavl, UINT_MAX-30, UINT_MAX);
+    assert((1==tavlCursorNext(&cursor, entries, 1))&&(UINT_MAX-19==entries[0].key));
+    assert((1==tavlCursorNext(&cursor, entries, 1))&&(UINT_MAX-9==entries[0].key));
+    assert(0==tavlCursorNext(&cursor, entries, 1));
+    tavlCursorInit(&cursor, &cacheMgmt.tavl, UINT_MAX, 1);
+    assert((1==tavlCursorNext(&cursor, entries, 7))&&(UINT_MAX-9==entries[0].key));
+    assert(invalidateRange(UINT_MAX-9, 10));
+    assert(NULL==searchAvl(cacheMgmt.tavl.root, UINT_MAX-9));
+    assert(writeToCache(UINT_MAX, 1));
+    assert(invalidateRange(UINT_MAX, 1));
+    assert(NULL==searchAvl(cacheMgmt.tavl.root, UINT_MAX));
+    assert(invalidateRange(UINT_MAX-19, 10));
+
+    invalidateRange(0, 30000);
+    assert(NULL==cacheMgmt.tavl.root);
+    assert(NUM_OF_SEGMENTS==cacheMgmt.free.count);
+}
+
 #ifdef __linux__
 void handler(int sig) {
   void *array[10];
@@ -211,5 +1456,18 @@ void main(void) {
     printf("Checking the LRU is empty\n");
     assert(cacheMgmt.lru.head.next==&cacheMgmt.lru.tail);
     assert(cacheMgmt.lru.tail.prev==&cacheMgmt.lru.head);
+    assert(0==cacheMgmt.lru.count);
+
+    testReclaim();
+    testPoolResize();
+    testWavl();
+    testOccupancy();
+    testBlockMaps();
+    testWriteAbsorb();
+    testRadix();
+    testJournal();
+    testMultiQueue();
+    testPoolPlacement();
+    testScanCursor();
     printf("Test successful\n");
 }
@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "tavl.h"
+#include "mq.h"
+
+//-----------------------------------------------------------
+// Functions
+//-----------------------------------------------------------
+/**
+ *  @brief  Executes a command against the cache
+ *  @param  mqCommand_t *pCommand - the command. Its result gets set.
+ *  @return None
+ */
+static void execute(mqCommand_t *pCommand) {
+    unsigned cached, dirty;
+
+    switch (pCommand->op) {
+    case MQ_READ:
+        tavlRangeCount(&cacheMgmt.tavl, pCommand->lba, pCommand->numberOfBlocks, &cached, &dirty);
+        pCommand->result = cached;
+        break;
+    case MQ_WRITE:
+        pCommand->result = writeToCache(pCommand->lba, pCommand->numberOfBlocks);
+        break;
+    case MQ_INVALIDATE:
+        pCommand->result = invalidateRange(pCommand->lba, pCommand->numberOfBlocks);
+        break;
+    case MQ_CLEAN:
+        pCommand->result = cleanRange(pCommand->lba, pCommand->numberOfBlocks);
+        break;
+    default:
+        assert(false);
+    }
+}
+
+/**
+ *  @brief  Executes a batch of commands of a queue and completes them together
+ *  @param  mq_t *pMq - the front end, mqQueue_t *pQueue - the queue
+ *  @return Number of commands executed
+ */
+static unsigned pollQueue(mq_t *pMq, mqQueue_t *pQueue) {
+    unsigned mask = pMq->depth - 1;
+    unsigned sqHead = atomic_load_explicit(&pQueue->sqHead, memory_order_relaxed);
+    unsigned cqTail = atomic_load_explicit(&pQueue->cqTail, memory_order_relaxed);
+    unsigned n, room, i;
+
+    // No more than the completion ring can take, so that a command never waits with its result.
+    // Each index is loaded once. MIN() evaluates its arguments twice.
+    n = atomic_load_explicit(&pQueue->sqTail, memory_order_acquire) - sqHead;
+    room = pMq->depth - (cqTail - atomic_load_explicit(&pQueue->cqHead, memory_order_acquire));
+    n = MIN(n, room);
+    n = MIN(n, MQ_BATCH);
+    for (i = 0; i < n; i++) {
+        mqCommand_t *pCommand = &pQueue->pCompletions[(cqTail + i) & mask];
+        *pCommand = pQueue->pSubmissions[(sqHead + i) & mask];
+        execute(pCommand);
+    }
+    if (0 < n) {
+        pMq->batches++;
+        pMq->commands += n;
+        atomic_store_explicit(&pQueue->sqHead, sqHead + n, memory_order_release);
+        atomic_store_explicit(&pQueue->cqTail, cqTail + n, memory_order_release);
+    }
+    return n;
+}
+
+/**
+ *  @brief  Tells whether any queue has a command the worker could take, with room for its completion
+ *  @param  mq_t *pMq - the front end
+ *  @return bool - true if so
+ */
+static bool pending(mq_t *pMq) {
+    mqQueue_t *pQueue;
+    unsigned i;
+
+    for (i = 0; i < pMq->numOfQueues; i++) {
+        pQueue = &pMq->pQueues[i];
+        // A submitter not reaping its completions holds its commands back until it does.
+        if ((atomic_load(&pQueue->sqTail) != atomic_load(&pQueue->sqHead)) &&
+            (atomic_load(&pQueue->cqTail) - atomic_load(&pQueue->cqHead) < pMq->depth)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ *  @brief  Worker thread. Owns the cache while the front end is up.
+ *  @param  void *arg - the front end
+ *  @return NULL
+ */
+static void *mqWorker(void *arg) {
+    mq_t *pMq = arg;
+    unsigned idle = 0;
+
+    while (false == atomic_load(&pMq->stop)) {
+        if (0 < mqPoll(pMq)) {
+            idle = 0;
+            continue;
+        }
+        if (MQ_SPIN > ++idle) {
+            continue;
+        }
+        // Announce the sleep before the last look, so that a submitter either sees the flag or we see its command.
+        pthread_mutex_lock(&pMq->lock);
+        atomic_store(&pMq->sleeping, true);
+        if ((false == pending(pMq)) && (false == atomic_load(&pMq->stop))) {
+            pthread_cond_wait(&pMq->wakeup, &pMq->lock);
+        }
+        atomic_store(&pMq->sleeping, false);
+        pthread_mutex_unlock(&pMq->lock);
+        idle = 0;
+    }
+    return NULL;
+}
+
+/**
+ *  @brief  Wakes the worker up if it sleeps
+ *  @param  mq_t *pMq - the front end
+ *  @return None
+ */
+static void wakeWorker(mq_t *pMq) {
+    if (atomic_load(&pMq->sleeping)) {
+        pthread_mutex_lock(&pMq->lock);
+        pthread_cond_signal(&pMq->wakeup);
+        pthread_mutex_unlock(&pMq->lock);
+    }
+}
+
+bool mqInit(mq_t *pMq, unsigned numOfQueues, unsigned depth, bool polled) {
+    unsigned i;
+
+    assert((0 < numOfQueues) && (0 < depth) && (0 == (depth & (depth - 1))));
+    pMq->pQueues = aligned_alloc(MQ_CACHELINE, sizeof(mqQueue_t) * numOfQueues);
+    if (NULL == pMq->pQueues) {
+        return false;
+    }
+    pthread_mutex_init(&pMq->lock, NULL);
+    pthread_cond_init(&pMq->wakeup, NULL);
+    memset(pMq->pQueues, 0, sizeof(mqQueue_t) * numOfQueues);
+    pMq->numOfQueues = numOfQueues;
+    pMq->depth = depth;
+    pMq->polled = polled;
+    pMq->batches = 0;
+    pMq->commands = 0;
+    atomic_init(&pMq->sleeping, false);
+    atomic_init(&pMq->stop, false);
+    for (i = 0; i < numOfQueues; i++) {
+        mqQueue_t *pQueue = &pMq->pQueues[i];
+        atomic_init(&pQueue->sqHead, 0);
+        atomic_init(&pQueue->sqTail, 0);
+        atomic_init(&pQueue->cqHead, 0);
+        atomic_init(&pQueue->cqTail, 0);
+        pQueue->pSubmissions = malloc(sizeof(mqCommand_t) * depth);
+        pQueue->pCompletions = malloc(sizeof(mqCommand_t) * depth);
+        if ((NULL == pQueue->pSubmissions) || (NULL == pQueue->pCompletions)) {
+            pMq->numOfQueues = i + 1;
+            pMq->polled = true;
+            mqShutdown(pMq);
+            return false;
+        }
+    }
+    if ((false == polled) && (0 != pthread_create(&pMq->worker, NULL, mqWorker, pMq))) {
+        pMq->polled = true;
+        mqShutdown(pMq);
+        return false;
+    }
+    return true;
+}
+
+void mqShutdown(mq_t *pMq) {
+    unsigned i;
+
+    if (false == pMq->polled) {
+        pthread_mutex_lock(&pMq->lock);
+        atomic_store(&pMq->stop, true);
+        pthread_cond_signal(&pMq->wakeup);
+        pthread_mutex_unlock(&pMq->lock);
+        pthread_join(pMq->worker, NULL);
+    }
+    // Execute what is left. The completion rings are emptied since nobody reaps them any more.
+    do {
+        for (i = 0; i < pMq->numOfQueues; i++) {
+            atomic_store(&pMq->pQueues[i].cqHead, atomic_load(&pMq->pQueues[i].cqTail));
+        }
+    } while (0 < mqPoll(pMq));
+    for (i = 0; i < pMq->numOfQueues; i++) {
+        free(pMq->pQueues[i].pSubmissions);
+        free(pMq->pQueues[i].pCompletions);
+    }
+    free(pMq->pQueues);
+    pMq->pQueues = NULL;
+    pMq->numOfQueues = 0;
+    pthread_cond_destroy(&pMq->wakeup);
+    pthread_mutex_destroy(&pMq->lock);
+}
+
+unsigned mqSubmit(mq_t *pMq, unsigned queue, const mqCommand_t *pCommands, unsigned numOfCommands) {
+    mqQueue_t *pQueue = &pMq->pQueues[queue];
+    unsigned mask = pMq->depth - 1;
+    unsigned sqTail = atomic_load_explicit(&pQueue->sqTail, memory_order_relaxed);
+    unsigned n, i;
+
+    assert(queue < pMq->numOfQueues);
+    n = pMq->depth - (sqTail - atomic_load_explicit(&pQueue->sqHead, memory_order_acquire));
+    n = MIN(n, numOfCommands);
+    for (i = 0; i < n; i++) {
+        pQueue->pSubmissions[(sqTail + i) & mask] = pCommands[i];
+    }
+    if (0 < n) {
+        // Sequentially consistent, to be ordered against the load of the sleeping flag.
+        atomic_store(&pQueue->sqTail, sqTail + n);
+        if (false == pMq->polled) {
+            wakeWorker(pMq);
+        }
+    }
+    return n;
+}
+
+unsigned mqReap(mq_t *pMq, unsigned queue, mqCommand_t *pCompletions, unsigned max) {
+    mqQueue_t *pQueue = &pMq->pQueues[queue];
+    unsigned mask = pMq->depth - 1;
+    unsigned cqHead = atomic_load_explicit(&pQueue->cqHead, memory_order_relaxed);
+    unsigned n, i;
+
+    assert(queue < pMq->numOfQueues);
+    n = atomic_load_explicit(&pQueue->cqTail, memory_order_acquire) - cqHead;
+    n = MIN(n, max);
+    for (i = 0; i < n; i++) {
+        pCompletions[i] = pQueue->pCompletions[(cqHead + i) & mask];
+    }
+    if (0 < n) {
+        // Sequentially consistent as in mqSubmit(). The worker may sleep on a full completion ring.
+        atomic_store(&pQueue->cqHead, cqHead + n);
+        if (false == pMq->polled) {
+            wakeWorker(pMq);
+        }
+    }
+    return n;
+}
+
+unsigned mqPoll(mq_t *pMq) {
+    unsigned i, n = 0;
+
+    for (i = 0; i < pMq->numOfQueues; i++) {
+        n += pollQueue(pMq, &pMq->pQueues[i]);
+    }
+    return n;
+}
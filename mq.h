@@ -0,0 +1,109 @@
+#ifndef __MQ_H
+#define __MQ_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+//-----------------------------------------------------------
+// Macros
+//-----------------------------------------------------------
+// Command operations
+#define MQ_READ         (1)     // Looks up the range. result is the number of cached blocks.
+#define MQ_WRITE        (2)     // writeToCache(). result is 1, or 0 if everything is dirty or a pinned segment is in the way.
+#define MQ_INVALIDATE   (3)     // invalidateRange(). result is 1, or 0 on allocation failure.
+#define MQ_CLEAN        (4)     // cleanRange(), once a destage completes. result is 1, or 0 on allocation failure.
+
+#define MQ_CACHELINE    (64)
+#define MQ_BATCH        (32)    // Commands taken from a queue at a time
+#define MQ_SPIN         (1000)  // Empty polls before the worker goes to sleep
+
+//-----------------------------------------------------------
+// Structure definitions
+//-----------------------------------------------------------
+typedef struct mqCommand {
+    unsigned    op;
+    unsigned    lba;
+    unsigned    numberOfBlocks;
+    unsigned    result;         // Set on completion
+    void        *tag;           // Caller's context, returned as is
+} mqCommand_t;
+
+// A submission ring and a completion ring of the same depth, each with one producer and one consumer.
+// The submitter produces commands and consumes completions, the worker does the opposite.
+// Indexes run freely and are masked on access. Each one lives on its own cache line.
+typedef struct mqQueue {
+    _Alignas(MQ_CACHELINE) atomic_uint sqHead;     // next command the worker takes
+    _Alignas(MQ_CACHELINE) atomic_uint sqTail;     // next free submission slot
+    _Alignas(MQ_CACHELINE) atomic_uint cqHead;     // next completion the submitter reaps
+    _Alignas(MQ_CACHELINE) atomic_uint cqTail;     // next free completion slot
+    mqCommand_t *pSubmissions;
+    mqCommand_t *pCompletions;
+} mqQueue_t;
+
+// Multi-queue front end of the cache.
+// One queue per submitting core, all served by the single owner of cacheMgmt - a worker thread, or the
+// caller of mqPoll() in polled mode. Commands of a queue are executed and completed in submission order,
+// so commands to the same LBA keep their order as long as they go through the same queue.
+typedef struct mq {
+    mqQueue_t       *pQueues;
+    unsigned        numOfQueues;
+    unsigned        depth;          // power of 2
+    bool            polled;
+    pthread_t       worker;
+    pthread_mutex_t lock;
+    pthread_cond_t  wakeup;
+    atomic_bool     sleeping;       // the worker is, or is about to be, waiting for wakeup
+    atomic_bool     stop;
+    unsigned long   batches;        // batches executed, counted by the owner of the cache
+    unsigned long   commands;       // commands executed, counted by the owner of the cache
+} mq_t;
+
+//-----------------------------------------------------------
+// Functions
+//-----------------------------------------------------------
+/**
+ *  @brief  Sets up the queues and, unless polled, starts the worker thread.
+ *          From then on, only the worker, or the caller of mqPoll(), may touch the cache.
+ *  @param  mq_t *pMq - the front end
+ *          unsigned numOfQueues - number of queues, typically one per submitting core
+ *          unsigned depth - number of commands per queue, a power of 2
+ *          bool polled - no worker thread if true. Commands are executed by mqPoll().
+ *  @return bool - false if memory or the thread could not be allocated
+ */
+extern bool mqInit(mq_t *pMq, unsigned numOfQueues, unsigned depth, bool polled);
+
+/**
+ *  @brief  Executes what is left in the queues, stops the worker thread and frees the queues.
+ *          Completions not reaped are dropped.
+ *  @param  mq_t *pMq - the front end
+ *  @return None
+ */
+extern void mqShutdown(mq_t *pMq);
+
+/**
+ *  @brief  Queues commands. Only one thread may submit to a queue.
+ *  @param  mq_t *pMq - the front end, unsigned queue - queue index
+ *          const mqCommand_t *pCommands - commands, unsigned numOfCommands - number of commands
+ *  @return Number of commands queued, fewer than numOfCommands if the queue is full
+ */
+extern unsigned mqSubmit(mq_t *pMq, unsigned queue, const mqCommand_t *pCommands, unsigned numOfCommands);
+
+/**
+ *  @brief  Takes completed commands, in submission order. Only the submitter of the queue may reap it.
+ *          Once the completion ring is full, commands of the queue wait until their completions are reaped.
+ *  @param  mq_t *pMq - the front end, unsigned queue - queue index
+ *          mqCommand_t *pCompletions - filled with the completed commands, unsigned max - room in pCompletions
+ *  @return Number of completions taken
+ */
+extern unsigned mqReap(mq_t *pMq, unsigned queue, mqCommand_t *pCompletions, unsigned max);
+
+/**
+ *  @brief  Executes a batch of commands from each queue. Done by the worker thread, or by the
+ *          single polling thread in polled mode.
+ *  @param  mq_t *pMq - the front end
+ *  @return Number of commands executed
+ */
+extern unsigned mqPoll(mq_t *pMq);
+
+#endif // __MQ_H
@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include "pool.h"
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+//-----------------------------------------------------------
+// Macros
+//-----------------------------------------------------------
+#ifdef __linux__
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB         (0x40000)
+#endif
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT      (26)
+#endif
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE       (14)
+#endif
+#define MPOL_PREFERRED      (1)
+#endif
+#define POOL_2M             (2UL << 20)
+#define POOL_1G             (1UL << 30)
+
+//-----------------------------------------------------------
+// Functions
+//-----------------------------------------------------------
+#ifdef __linux__
+/**
+ *  @brief  Maps anonymous memory, of hugetlb pages if a page shift is given
+ *  @param  size_t length - bytes, a multiple of the page size
+ *          unsigned pageShift - log2 of the hugetlb page size, 0 for base pages
+ *  @return Pointer to the mapping, or NULL if it failed
+ */
+static void *mapAnonymous(size_t length, unsigned pageShift) {
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    void *p;
+
+    if (0 != pageShift) {
+        flags |= MAP_HUGETLB | (pageShift << MAP_HUGE_SHIFT);
+    }
+    p = mmap(NULL, length, PROT_READ | PROT_WRITE, flags, -1, 0);
+    return (MAP_FAILED == p) ? NULL : p;
+}
+
+/**
+ *  @brief  Rounds the given size up to a multiple of the given alignment
+ *  @param  size_t size, size_t alignment - a power of 2
+ *  @return size_t rounded size
+ */
+static size_t roundUp(size_t size, size_t alignment) {
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+#endif
+
+void *poolAlloc(size_t size, const poolPlacement_t *pPlacement, poolMapping_t *pMapping) {
+    void *p = NULL;
+
+    pMapping->length = 0;
+    pMapping->pageSize = POOL_PAGE_DEFAULT;
+    pMapping->bound = false;
+#ifdef __linux__
+    unsigned pageSize = pPlacement->pageSize;
+
+    // Try the requested page size, then step down.
+    if (POOL_PAGE_1G == pageSize) {
+        pMapping->length = roundUp(size, POOL_1G);
+        p = mapAnonymous(pMapping->length, 30);
+        if (NULL == p) {
+            pageSize = POOL_PAGE_2M;
+        }
+    }
+    if ((NULL == p) && (POOL_PAGE_2M == pageSize)) {
+        pMapping->length = roundUp(size, POOL_2M);
+        p = mapAnonymous(pMapping->length, 21);
+        if (NULL == p) {
+            pageSize = POOL_PAGE_THP;
+        }
+    }
+    if ((NULL == p) && ((POOL_PAGE_THP == pageSize) || (POOL_PAGE_SMALL == pageSize))) {
+        // Whole 2M extents, so that the kernel can back all of it with transparent hugepages.
+        pMapping->length = roundUp(size, (POOL_PAGE_THP == pageSize) ? POOL_2M : (size_t)sysconf(_SC_PAGESIZE));
+        p = mapAnonymous(pMapping->length, 0);
+        if ((NULL != p) && (POOL_PAGE_THP == pageSize) && (0 != madvise(p, pMapping->length, MADV_HUGEPAGE))) {
+            // No THP in this kernel. Base pages it is.
+            pageSize = POOL_PAGE_SMALL;
+        }
+    }
+    if (NULL != p) {
+        pMapping->pageSize = pageSize;
+        if (pPlacement->bind && (pPlacement->numaNode < 8 * sizeof(unsigned long))) {
+            unsigned long nodeMask = 1UL << pPlacement->numaNode;
+            // Preferred rather than bound, so that a full node spills over instead of failing.
+            pMapping->bound = (0 == syscall(SYS_mbind, p, pMapping->length, MPOL_PREFERRED,
+                &nodeMask, 8 * sizeof(nodeMask), 0));
+        }
+        return p;
+    }
+    pMapping->length = 0;
+#endif
+    (void)pPlacement;
+    return malloc(size);
+}
+
+void poolFree(void *p, const poolMapping_t *pMapping) {
+    if (NULL == p) {
+        return;
+    }
+#ifdef __linux__
+    if (0 != pMapping->length) {
+        munmap(p, pMapping->length);
+        return;
+    }
+#endif
+    (void)pMapping;
+    free(p);
+}
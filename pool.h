@@ -0,0 +1,56 @@
+#ifndef __POOL_H
+#define __POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+//-----------------------------------------------------------
+// Macros
+//-----------------------------------------------------------
+// Page sizes backing a pool chunk
+#define POOL_PAGE_DEFAULT   (0)     // malloc()
+#define POOL_PAGE_SMALL     (1)     // base pages, no transparent hugepages
+#define POOL_PAGE_THP       (2)     // base pages, transparent hugepages requested with madvise()
+#define POOL_PAGE_2M        (3)     // 2M hugetlb pages
+#define POOL_PAGE_1G        (4)     // 1G hugetlb pages
+
+//-----------------------------------------------------------
+// Structure definitions
+//-----------------------------------------------------------
+// Where the segments and nodes of new pool chunks go. All zero is plain malloc().
+typedef struct poolPlacement {
+    unsigned    pageSize;       // POOL_PAGE_*
+    bool        bind;           // prefer the NUMA node below
+    unsigned    numaNode;
+} poolPlacement_t;
+
+// How a pool array got allocated, so that it is freed the same way
+typedef struct poolMapping {
+    size_t      length;         // bytes mapped, 0 if malloc()
+    unsigned    pageSize;       // POOL_PAGE_* actually obtained
+    bool        bound;          // the NUMA policy got applied
+} poolMapping_t;
+
+//-----------------------------------------------------------
+// Functions
+//-----------------------------------------------------------
+/**
+ *  @brief  Allocates a pool array with the given placement.
+ *          Hugetlb pages fall back to transparent hugepages and then to base pages if none are reserved,
+ *          a NUMA node that cannot be bound to is ignored, and all of it falls back to malloc()
+ *          where mmap() is not available. Memory is not touched, so that the first touch is on the preferred node.
+ *  @param  size_t size - bytes needed
+ *          const poolPlacement_t *pPlacement - requested placement
+ *          poolMapping_t *pMapping - set to what was obtained
+ *  @return Pointer to the array, or NULL if out of memory
+ */
+extern void *poolAlloc(size_t size, const poolPlacement_t *pPlacement, poolMapping_t *pMapping);
+
+/**
+ *  @brief  Frees a pool array allocated by poolAlloc()
+ *  @param  void *p - the array, const poolMapping_t *pMapping - as set by poolAlloc()
+ *  @return None
+ */
+extern void poolFree(void *p, const poolMapping_t *pMapping);
+
+#endif // __POOL_H
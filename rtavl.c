@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <assert.h>
+#include "tavl.h"
+#include "rtavl.h"
+
+//-----------------------------------------------------------
+// Functions
+//-----------------------------------------------------------
+/**
+ *  @brief  Returns the bucket of the given LBA
+ *  @param  rtavl_t *pRtavl - the tree, unsigned lba - the LBA
+ *  @return unsigned index of the bucket
+ */
+static unsigned bucketOf(rtavl_t *pRtavl, unsigned lba) {
+    return MIN(lba >> pRtavl->shift, pRtavl->numOfBuckets - 1);
+}
+
+/**
+ *  @brief  Finds the node with the highest key in the buckets below the given one
+ *  @param  rtavl_t *pRtavl - the tree, unsigned b - the bucket
+ *  @return The node, or &pRtavl->tavl.lowest if all buckets below are empty
+ */
+static tavl_node_t *highestBelow(rtavl_t *pRtavl, unsigned b) {
+    tavl_node_t *head;
+
+    // With a dense LBA space, the bucket right below is rarely empty.
+    while (0 < b) {
+        b--;
+        head = pRtavl->bucket[b];
+        if (NULL != head) {
+            while (NULL != head->right) {
+                head = head->right;
+            }
+            return head;
+        }
+    }
+    return &pRtavl->tavl.lowest;
+}
+
+bool initRtavl(rtavl_t *pRtavl, unsigned shift, unsigned numOfBuckets) {
+	assert(0<numOfBuckets);
+    initTavl(&pRtavl->tavl);
+    pRtavl->bucket = calloc(numOfBuckets, sizeof(tavl_node_t *));
+    if (NULL == pRtavl->bucket) {
+        return false;
+    }
+    pRtavl->numOfBuckets = numOfBuckets;
+    pRtavl->shift = shift;
+    return true;
+}
+
+void freeRtavl(rtavl_t *pRtavl) {
+    free(pRtavl->bucket);
+    pRtavl->bucket = NULL;
+    pRtavl->numOfBuckets = 0;
+}
+
+tavl_node_t *searchRtavl(rtavl_t *pRtavl, unsigned lba) {
+    unsigned b = bucketOf(pRtavl, lba);
+
+    if (NULL == pRtavl->bucket[b]) {
+        return highestBelow(pRtavl, b);
+    }
+    // Below the lowest key of the bucket, searchTavl() follows the Thread into the buckets below.
+    return searchTavl(pRtavl->bucket[b], lba);
+}
+
+void insertToRtavl(rtavl_t *pRtavl, tavl_node_t *x) {
+    unsigned b = bucketOf(pRtavl, x->pSeg->key);
+
+    pRtavl->tavl.active_nodes++;
+    if (NULL == pRtavl->bucket[b]) {
+        // First node of the bucket. Link it after the highest node of the buckets below.
+        insertAfter(x, highestBelow(pRtavl, b));
+        pRtavl->bucket[b] = insertNode(NULL, x);
+    } else {
+        // The Thread neighbors of a leaf are right even across buckets.
+        pRtavl->bucket[b] = _insertToTavl(pRtavl->bucket[b], x);
+    }
+}
+
+void removeFromRtavl(rtavl_t *pRtavl, segment_t *x) {
+    unsigned b = bucketOf(pRtavl, x->key);
+
+    pRtavl->tavl.active_nodes--;
+    pRtavl->bucket[b] = removeNode(pRtavl->bucket[b], x);
+}
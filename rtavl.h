@@ -0,0 +1,69 @@
+#ifndef __RTAVL_H
+#define __RTAVL_H
+
+#include <stdbool.h>
+#include "tavl.h"
+
+//-----------------------------------------------------------
+// Structure definitions
+//-----------------------------------------------------------
+// Radix-directed TAVL tree.
+// A direct-mapped array of buckets, indexed by the high bits of the LBA, each pointing at a small AVL tree.
+// All nodes of all buckets are linked in one Thread, in LBA order.
+// It is a standalone index. The cache operations of tavl.c only know cacheMgmt.tavl, so the nodes and
+// segments must be the caller's own, never taken from the cache pool.
+typedef struct rtavl {
+    // Sentinels of the Thread and number of nodes. The root is not used.
+    tavl_t      tavl;
+    tavl_node_t **bucket;
+    unsigned    numOfBuckets;
+    // Bucket of an LBA is (lba >> shift), the last bucket taking any LBA beyond.
+    unsigned    shift;
+} rtavl_t;
+
+//-----------------------------------------------------------
+// Functions
+//-----------------------------------------------------------
+/**
+ *  @brief  Initializes an empty radix-directed TAVL tree
+ *  @param  rtavl_t *pRtavl - the tree
+ *          unsigned shift - number of low LBA bits within a bucket
+ *          unsigned numOfBuckets - number of buckets
+ *  @return bool - false if the bucket array could not be allocated
+ */
+extern bool initRtavl(rtavl_t *pRtavl, unsigned shift, unsigned numOfBuckets);
+
+/**
+ *  @brief  Frees the bucket array. Nodes are not touched.
+ *  @param  rtavl_t *pRtavl - the tree
+ *  @return None
+ */
+extern void freeRtavl(rtavl_t *pRtavl);
+
+/**
+ *  @brief  Searches the radix-directed TAVL tree for the given LBA
+ *          Same as searchTavl(), but only descends the tree of the bucket of the LBA.
+ *  @param  rtavl_t *pRtavl - the tree
+ *          unsigned lba - an LBA to be searched
+ *  @return The node that contains a key that is equal or smaller than the given LBA,
+ *          or &pRtavl->tavl.lowest if there is none
+ */
+extern tavl_node_t *searchRtavl(rtavl_t *pRtavl, unsigned lba);
+
+/**
+ *  @brief  Inserts the given node into the tree of its bucket and into the Thread
+ *  @param  rtavl_t *pRtavl - the tree
+ *          tavl_node_t *x - pointer to the node to be inserted
+ *  @return None
+ */
+extern void insertToRtavl(rtavl_t *pRtavl, tavl_node_t *x);
+
+/**
+ *  @brief  Removes the given segment from the tree of its bucket and from the Thread
+ *  @param  rtavl_t *pRtavl - the tree
+ *          segment_t *x - segment to be removed
+ *  @return None
+ */
+extern void removeFromRtavl(rtavl_t *pRtavl, segment_t *x);
+
+#endif // __RTAVL_H
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <limits.h>
 #include <assert.h>
 #include "tavl.h"
 
@@ -11,6 +12,7 @@
 segment_t       *pSegmentPool;
 tavl_node_t     *pNodePool;
 cManagement_t   cacheMgmt;
+unsigned long   tavlRotations;
 
 //-----------------------------------------------------------
 // Functions
@@ -18,8 +20,11 @@ cManagement_t   cacheMgmt;
 void initSegment(segment_t *pSeg) {
     pSeg->prev = NULL;
     pSeg->next = NULL;
+    pSeg->pList = NULL;
     pSeg->key = 0;
     pSeg->numberOfBlocks = 0;
+    pSeg->refCount = 0;
+    pSeg->pMap = NULL;
 }
 
 void initNode(tavl_node_t *pNode) {
@@ -28,6 +33,8 @@ void initNode(tavl_node_t *pNode) {
     pNode->lower = NULL;
     pNode->higher = NULL;
     pNode->height = 1;
+    pNode->subtreeBlocks = 0;
+    pNode->subtreeDirty = 0;
 }
 
 void pushToTail(segment_t *pSeg, segList_t *pList) {
@@ -36,6 +43,8 @@ void pushToTail(segment_t *pSeg, segList_t *pList) {
     pSeg->prev=pPrev;
     pList->tail.prev=pSeg;
     pSeg->next=&(pList->tail);
+    pSeg->pList=pList;
+    pList->count++;
 }
 
 void removeFromList(segment_t *pSeg) {
@@ -45,6 +54,40 @@ void removeFromList(segment_t *pSeg) {
     pNext->prev=pPrev;
     pSeg->prev=NULL;
     pSeg->next=NULL;
+    if (NULL!=pSeg->pList) {
+        pSeg->pList->count--;
+        pSeg->pList=NULL;
+    }
+}
+
+/**
+ *  @brief  Returns the number of 64 bit words of each bitmap of a segment
+ *  @param  unsigned numberOfBlocks - number of blocks in the segment
+ *  @return unsigned number of words
+ */
+static unsigned mapWords(unsigned numberOfBlocks) {
+    return (numberOfBlocks + 63) / 64;
+}
+
+void moveToList(segment_t *pSeg, segList_t *pList) {
+    bool wasDirty = (&cacheMgmt.dirty == pSeg->pList);
+    unsigned words, i;
+
+    if (NULL != pSeg->pList) {
+        removeFromList(pSeg);
+    }
+    pushToTail(pSeg, pList);
+    // Keep the dirty bitmap in line with the list. All valid blocks are dirty in the dirty list, none in the LRU list.
+    if ((NULL != pSeg->pMap) && ((&cacheMgmt.dirty == pList) || (&cacheMgmt.lru == pList))) {
+        words = mapWords(pSeg->numberOfBlocks);
+        for (i = 0; i < words; i++) {
+            pSeg->pMap[words + i] = (&cacheMgmt.dirty == pList) ? pSeg->pMap[i] : 0;
+        }
+    }
+    // A node in the tree is always linked in the Thread.
+    if ((wasDirty != (&cacheMgmt.dirty == pList)) && (NULL != ((tavl_node_t *)(pSeg->pNode))->lower)) {
+        tavlUpdateCounts(&cacheMgmt.tavl, pSeg);
+    }
 }
 
 segment_t *popFromHead(segList_t *pList) {
@@ -88,25 +131,198 @@ unsigned avlHeight(tavl_node_t *head) {
     return head->height;
 }
 
-tavl_node_t *rightRotation(tavl_node_t *head) {
+/**
+ *  @brief  Sets or clears the bits [from..to) of the given bitmap
+ *  @param  uint64_t *pMap - the bitmap, unsigned from, unsigned to - bit range, bool set - set if true
+ *  @return None
+ */
+static void mapUpdate(uint64_t *pMap, unsigned from, unsigned to, bool set) {
+    unsigned bit, n;
+    uint64_t mask;
+
+    while (from < to) {
+        bit = from % 64;
+        n = MIN(64 - bit, to - from);
+        mask = (64 == n) ? ~0ULL : (((1ULL << n) - 1) << bit);
+        if (set) {
+            pMap[from / 64] |= mask;
+        } else {
+            pMap[from / 64] &= ~mask;
+        }
+        from += n;
+    }
+}
+
+/**
+ *  @brief  Counts the set bits within [from..to) of the given bitmap
+ *  @param  uint64_t *pMap - the bitmap, unsigned from, unsigned to - bit range
+ *  @return unsigned number of set bits
+ */
+static unsigned mapCount(const uint64_t *pMap, unsigned from, unsigned to) {
+    unsigned bit, n, count = 0;
+    uint64_t mask;
+
+    while (from < to) {
+        bit = from % 64;
+        n = MIN(64 - bit, to - from);
+        mask = (64 == n) ? ~0ULL : (((1ULL << n) - 1) << bit);
+        count += __builtin_popcountll(pMap[from / 64] & mask);
+        from += n;
+    }
+    return count;
+}
+
+/**
+ *  @brief  Returns the number of cached blocks in the given segment
+ *  @param  segment_t *pSeg - the segment
+ *  @return unsigned number of blocks
+ */
+static unsigned segCachedBlocks(segment_t *pSeg) {
+    if (NULL != pSeg->pMap) {
+        return mapCount(pSeg->pMap, 0, pSeg->numberOfBlocks);
+    }
+    return pSeg->numberOfBlocks;
+}
+
+/**
+ *  @brief  Returns the number of dirty blocks in the given segment
+ *  @param  segment_t *pSeg - the segment
+ *  @return unsigned number of blocks
+ */
+static unsigned segDirtyBlocks(segment_t *pSeg) {
+    if (NULL != pSeg->pMap) {
+        return mapCount(pSeg->pMap + mapWords(pSeg->numberOfBlocks), 0, pSeg->numberOfBlocks);
+    }
+    if (&cacheMgmt.dirty == pSeg->pList) {
+        return pSeg->numberOfBlocks;
+    }
+    return 0;
+}
+
+/**
+ *  @brief  Counts the cached and dirty blocks of the given segment that are below the given LBA
+ *  @param  segment_t *pSeg - the segment, unsigned lba - the LBA, within the range of the segment
+ *          unsigned *pCached, unsigned *pDirty - counts to be added to
+ *  @return None
+ */
+static void segBlocksBelow(segment_t *pSeg, unsigned lba, unsigned *pCached, unsigned *pDirty) {
+    unsigned n = lba - pSeg->key;
+    if (NULL != pSeg->pMap) {
+        *pCached += mapCount(pSeg->pMap, 0, n);
+        *pDirty += mapCount(pSeg->pMap + mapWords(pSeg->numberOfBlocks), 0, n);
+        return;
+    }
+    *pCached += n;
+    if (&cacheMgmt.dirty == pSeg->pList) {
+        *pDirty += n;
+    }
+}
+
+/**
+ *  @brief  Returns the offset of the n-th cached block in the given segment
+ *  @param  segment_t *pSeg - the segment, unsigned n - 0 based rank, smaller than segCachedBlocks()
+ *  @return unsigned offset of the block from the key of the segment
+ */
+static unsigned segSelectBlock(segment_t *pSeg, unsigned n) {
+    unsigned i, count;
+    uint64_t word;
+
+    if (NULL == pSeg->pMap) {
+        return n;
+    }
+    for (i = 0; ; i++) {
+        word = pSeg->pMap[i];
+        count = __builtin_popcountll(word);
+        if (n < count) {
+            break;
+        }
+        n -= count;
+    }
+    // Drop the lower set bits till the n-th one is the lowest.
+    while (0 < n) {
+        word &= word - 1;
+        n--;
+    }
+    return i * 64 + __builtin_ctzll(word);
+}
+
+/**
+ *  @brief  Returns the number of cached blocks in the sub-tree of the given node
+ *  @param  tavl_node_t *head - a node in the tree, or NULL
+ *  @return unsigned number of blocks
+ */
+static unsigned subtreeBlocks(tavl_node_t *head) {
+    if (NULL == head) {
+        return 0;
+    }
+    return head->subtreeBlocks;
+}
+
+/**
+ *  @brief  Returns the number of dirty blocks in the sub-tree of the given node
+ *  @param  tavl_node_t *head - a node in the tree, or NULL
+ *  @return unsigned number of blocks
+ */
+static unsigned subtreeDirty(tavl_node_t *head) {
+    if (NULL == head) {
+        return 0;
+    }
+    return head->subtreeDirty;
+}
+
+/**
+ *  @brief  Recomputes the block counts of the given node from its segment and its children
+ *  @param  tavl_node_t *head - a node in the tree - cannot be NULL
+ *  @return None
+ */
+static void updateCounts(tavl_node_t *head) {
+    head->subtreeBlocks = segCachedBlocks(head->pSeg) + subtreeBlocks(head->left) + subtreeBlocks(head->right);
+    head->subtreeDirty = segDirtyBlocks(head->pSeg) + subtreeDirty(head->left) + subtreeDirty(head->right);
+}
+
+/**
+ *  @brief  Rotates the sub-tree to right (clockwise) without touching the height/rank
+ *  @param  tavl_node_t *head - a node in the tree - cannot be NULL
+ *  @return root of the rotated sub-tree
+ */
+static tavl_node_t *rotateRight(tavl_node_t *head) {
 	assert(NULL!=head);
 	assert(NULL!=head->left);
     tavl_node_t *newHead = head->left;
-	assert(NULL!=newHead);
     head->left = newHead->right;
     newHead->right = head;
-    head->height = 1 + MAX(avlHeight(head->left), avlHeight(head->right));
-    newHead->height = 1 + MAX(avlHeight(newHead->left), avlHeight(newHead->right));
+    updateCounts(head);
+    updateCounts(newHead);
+    tavlRotations++;
     return newHead;
 }
 
-tavl_node_t *leftRotation(tavl_node_t *head) {
+/**
+ *  @brief  Rotates the sub-tree to left (counter clockwise) without touching the height/rank
+ *  @param  tavl_node_t *head - a node in the tree - cannot be NULL
+ *  @return root of the rotated sub-tree
+ */
+static tavl_node_t *rotateLeft(tavl_node_t *head) {
 	assert(NULL!=head);
 	assert(NULL!=head->right);
     tavl_node_t *newHead = head->right;
-	assert(NULL!=newHead);
     head->right = newHead->left;
     newHead->left = head;
+    updateCounts(head);
+    updateCounts(newHead);
+    tavlRotations++;
+    return newHead;
+}
+
+tavl_node_t *rightRotation(tavl_node_t *head) {
+    tavl_node_t *newHead = rotateRight(head);
+    head->height = 1 + MAX(avlHeight(head->left), avlHeight(head->right));
+    newHead->height = 1 + MAX(avlHeight(newHead->left), avlHeight(newHead->right));
+    return newHead;
+}
+
+tavl_node_t *leftRotation(tavl_node_t *head) {
+    tavl_node_t *newHead = rotateLeft(head);
     head->height = 1 + MAX(avlHeight(head->left), avlHeight(head->right));
     newHead->height = 1 + MAX(avlHeight(newHead->left), avlHeight(newHead->right));
     return newHead;
@@ -114,6 +330,7 @@ tavl_node_t *leftRotation(tavl_node_t *head) {
 
 tavl_node_t *insertNode(tavl_node_t *head, tavl_node_t *x) {
     if (NULL == head) {
+        updateCounts(x);
         return x;
     }
     if (x->pSeg->key < head->pSeg->key) {
@@ -121,6 +338,7 @@ tavl_node_t *insertNode(tavl_node_t *head, tavl_node_t *x) {
     } else if (x->pSeg->key > head->pSeg->key) {
         head->right = insertNode(head->right, x);
     }
+    updateCounts(head);
     head->height = 1 + MAX(avlHeight(head->left), avlHeight(head->right));
     int bal = avlHeight(head->left) - avlHeight(head->right);
     if (bal > 1) {
@@ -185,6 +403,7 @@ tavl_node_t *removeNode(tavl_node_t *head, segment_t *x) {
     if (NULL == head) {
         return NULL;
     }
+    updateCounts(head);
     head->height = 1 + MAX(avlHeight(head->left), avlHeight(head->right));
     int bal = avlHeight(head->left) - avlHeight(head->right);
     if (bal > 1) {
@@ -205,6 +424,113 @@ tavl_node_t *removeNode(tavl_node_t *head, segment_t *x) {
     return head;
 }
 
+/**
+ *  @brief  Restores the WAVL rank rule at the given node after a removal in one of its sub-trees
+ *  @param  tavl_node_t *head - a node in the WAVL tree - cannot be NULL
+ *  @return root of the sub-tree
+ */
+static tavl_node_t *wavlRebalance(tavl_node_t *head) {
+    tavl_node_t *y, *w;
+    unsigned r = head->height;
+
+    // A leaf must be a 1,1 node. A 2,2 leaf is demoted.
+    if ((NULL == head->left) && (NULL == head->right)) {
+        head->height = 1;
+        return head;
+    }
+    if (3 == r - avlHeight(head->left)) {
+        y = head->right;
+        if (2 == r - y->height) {
+            // 3,2 node - demote and let the parent check.
+            head->height--;
+            return head;
+        }
+        if ((2 == y->height - avlHeight(y->left)) && (2 == y->height - avlHeight(y->right))) {
+            // 3,1 node with a 2,2 sibling - demote both and let the parent check.
+            head->height--;
+            y->height--;
+            return head;
+        }
+        if (1 == y->height - avlHeight(y->right)) {
+            // Single rotation. The rank of the sub-tree is unchanged, so this is the last step.
+            y->height++;
+            head->height--;
+            if ((NULL == head->left) && (NULL == y->left)) {
+                head->height--;
+            }
+            return rotateLeft(head);
+        }
+        // Double rotation. The rank of the sub-tree is unchanged, so this is the last step.
+        w = y->left;
+        w->height += 2;
+        y->height--;
+        head->height -= 2;
+        head->right = rotateRight(y);
+        return rotateLeft(head);
+    }
+    if (3 == r - avlHeight(head->right)) {
+        y = head->left;
+        if (2 == r - y->height) {
+            head->height--;
+            return head;
+        }
+        if ((2 == y->height - avlHeight(y->left)) && (2 == y->height - avlHeight(y->right))) {
+            head->height--;
+            y->height--;
+            return head;
+        }
+        if (1 == y->height - avlHeight(y->left)) {
+            y->height++;
+            head->height--;
+            if ((NULL == head->right) && (NULL == y->right)) {
+                head->height--;
+            }
+            return rotateRight(head);
+        }
+        w = y->right;
+        w->height += 2;
+        y->height--;
+        head->height -= 2;
+        head->left = rotateLeft(y);
+        return rotateRight(head);
+    }
+    return head;
+}
+
+tavl_node_t *removeWavlNode(tavl_node_t *head, segment_t *x) {
+    if (NULL == head) {
+        return NULL;
+    }
+    if (x->key < head->pSeg->key) {
+        head->left = removeWavlNode(head->left, x);
+    } else if (x->key > head->pSeg->key) {
+        head->right = removeWavlNode(head->right, x);
+    } else {
+        tavl_node_t *r = head->right;
+        if (NULL == head->right) {
+            tavl_node_t *l = head->left;
+            removeFromThread(head);
+            return l;
+        } else if (NULL == head->left) {
+            removeFromThread(head);
+            return r;
+        } else {
+            // Same as removeNode(), swap the segment with the next one in the thread.
+            r = (tavl_node_t *)(head->higher);
+            segment_t *pHeadSeg = head->pSeg;
+            segment_t *pRSeg = r->pSeg;
+            head->pSeg = pRSeg;
+            r->pSeg = pHeadSeg;
+            pHeadSeg->pNode = (void *)r;
+            pRSeg->pNode = (void *)head;
+
+            head->right = removeWavlNode(head->right, r->pSeg);
+        }
+    }
+    updateCounts(head);
+    return wavlRebalance(head);
+}
+
 tavl_node_t *searchAvl(tavl_node_t *head, unsigned key) {
     if (NULL == head) {
         return NULL;
@@ -272,6 +598,7 @@ tavl_node_t *_insertToTavl(tavl_node_t *head, tavl_node_t *x) {
             head->right = _insertToTavl(head->right, x);
         }
     }
+    updateCounts(head);
     head->height = 1 + MAX(avlHeight(head->left), avlHeight(head->right));
     int bal = avlHeight(head->left) - avlHeight(head->right);
     if (bal > 1) {
@@ -292,28 +619,974 @@ tavl_node_t *_insertToTavl(tavl_node_t *head, tavl_node_t *x) {
     return head;
 }
 
+/**
+ *  @brief  Inserts the given node into the given WAVL tree that is NOT empty, and into the Thread.
+ *          Under insert-only workloads, the resulting tree is an AVL tree.
+ *  @param  tavl_node_t *head - root of the tree,
+ *          tavl_node_t *x - pointer to the node to be inserted
+ *  @return New root of the tree
+ */
+static tavl_node_t *_insertToWavl(tavl_node_t *head, tavl_node_t *x) {
+    tavl_node_t *c;
+
+	assert(NULL!=x);
+	assert(NULL!=x->pSeg);
+	assert(NULL!=head);
+	assert(NULL!=head->pSeg);
+    if (x->pSeg->key < head->pSeg->key) {
+        if (NULL==head->left) {
+            insertBefore(x, head);
+            head->left = x;
+        } else {
+            head->left = _insertToWavl(head->left, x);
+        }
+        updateCounts(head);
+        // Nothing to do unless the left child became a 0-child.
+        if (head->height != avlHeight(head->left)) {
+            return head;
+        }
+        if (1 == head->height - avlHeight(head->right)) {
+            // 0,1 node - promote and let the parent check.
+            head->height++;
+            return head;
+        }
+        // 0,2 node - rotate. This is the last step.
+        c = head->left;
+        if (2 == c->height - avlHeight(c->right)) {
+            head->height--;
+            return rotateRight(head);
+        }
+        c->right->height++;
+        c->height--;
+        head->height--;
+        head->left = rotateLeft(c);
+        return rotateRight(head);
+    } else if (x->pSeg->key > head->pSeg->key) {
+        if (NULL==head->right) {
+            insertAfter(x, head);
+            head->right = x;
+        } else {
+            head->right = _insertToWavl(head->right, x);
+        }
+        updateCounts(head);
+        if (head->height != avlHeight(head->right)) {
+            return head;
+        }
+        if (1 == head->height - avlHeight(head->left)) {
+            head->height++;
+            return head;
+        }
+        c = head->right;
+        if (2 == c->height - avlHeight(c->left)) {
+            head->height--;
+            return rotateLeft(head);
+        }
+        c->left->height++;
+        c->height--;
+        head->height--;
+        head->right = rotateRight(c);
+        return rotateLeft(head);
+    }
+    return head;
+}
+
 tavl_node_t *insertToTavl(tavl_t *pTavl, tavl_node_t *x) {
 	assert(NULL!=pTavl);
 	assert(NULL!=x);
     pTavl->active_nodes++;
+    updateCounts(x);
     if (NULL == pTavl->root) {
         pTavl->lowest.higher=x;
         x->lower=&pTavl->lowest;
         pTavl->highest.lower=x;
         x->higher=&pTavl->highest;
         return x;
+    } else if (pTavl->rankBalanced) {
+        return _insertToWavl(pTavl->root, x);
     } else {
         return _insertToTavl(pTavl->root, x);
     }
 }
 
-void freeNode(segment_t *x) {
+/**
+ *  @brief  Recomputes the block counts on the path from the given node to the node with the given key
+ *  @param  tavl_node_t *head - a node in the tree, or NULL
+ *          unsigned key - key of the node with changed counts
+ *  @return None
+ */
+static void refreshCounts(tavl_node_t *head, unsigned key) {
+    if (NULL == head) {
+        return;
+    }
+    if (key < head->pSeg->key) {
+        refreshCounts(head->left, key);
+    } else if (key > head->pSeg->key) {
+        refreshCounts(head->right, key);
+    }
+    updateCounts(head);
+}
+
+void tavlUpdateCounts(tavl_t *pTavl, segment_t *x) {
+    refreshCounts(pTavl->root, x->key);
+}
+
+/**
+ *  @brief  Counts the cached and dirty blocks below the given LBA
+ *  @param  tavl_node_t *head - root of the tree, or NULL
+ *          unsigned lba - the LBA
+ *          unsigned *pCached, unsigned *pDirty - counts
+ *  @return None
+ */
+static void countBelow(tavl_node_t *head, unsigned lba, unsigned *pCached, unsigned *pDirty) {
+    segment_t *pSeg;
+
+    *pCached = 0;
+    *pDirty = 0;
+    while (NULL != head) {
+        pSeg = head->pSeg;
+        if (lba <= pSeg->key) {
+            head = head->left;
+            continue;
+        }
+        // The whole left sub-tree is below the LBA.
+        *pCached += subtreeBlocks(head->left);
+        *pDirty += subtreeDirty(head->left);
+        if (lba - pSeg->key < pSeg->numberOfBlocks) {
+            // The LBA is within this segment, thus the right sub-tree is above it.
+            segBlocksBelow(pSeg, lba, pCached, pDirty);
+            return;
+        }
+        *pCached += segCachedBlocks(pSeg);
+        *pDirty += segDirtyBlocks(pSeg);
+        head = head->right;
+    }
+}
+
+/**
+ *  @brief  Returns the LBA right after the given range, clamped to UINT_MAX
+ *  @param  unsigned lba - first LBA, unsigned numberOfBlocks - number of blocks
+ *  @return unsigned end of the range
+ */
+static unsigned rangeEnd(unsigned lba, unsigned numberOfBlocks) {
+    return (numberOfBlocks > UINT_MAX - lba) ? UINT_MAX : lba + numberOfBlocks;
+}
+
+void tavlRangeCount(tavl_t *pTavl, unsigned lba, unsigned numberOfBlocks, unsigned *pCached, unsigned *pDirty) {
+    unsigned lowCached, lowDirty;
+
+    countBelow(pTavl->root, rangeEnd(lba, numberOfBlocks), pCached, pDirty);
+    countBelow(pTavl->root, lba, &lowCached, &lowDirty);
+    *pCached -= lowCached;
+    *pDirty -= lowDirty;
+}
+
+tavl_node_t *tavlSelectBlock(tavl_t *pTavl, unsigned n, unsigned *pLba) {
+    tavl_node_t *head = pTavl->root;
+    unsigned blocks;
+
+    while (NULL != head) {
+        blocks = subtreeBlocks(head->left);
+        if (n < blocks) {
+            head = head->left;
+            continue;
+        }
+        n -= blocks;
+        blocks = segCachedBlocks(head->pSeg);
+        if (n < blocks) {
+            *pLba = head->pSeg->key + segSelectBlock(head->pSeg, n);
+            return head;
+        }
+        n -= blocks;
+        head = head->right;
+    }
+    return NULL;
+}
+
+bool initBlockMaps(segment_t *pSeg) {
+    unsigned words = mapWords(pSeg->numberOfBlocks);
+
+    if (NULL != pSeg->pMap) {
+        return true;
+    }
+    if (pSeg->numberOfBlocks <= SEG_INLINE_BLOCKS) {
+        pSeg->pMap = pSeg->inlineMap;
+    } else {
+        pSeg->pMap = malloc(2 * words * sizeof(uint64_t));
+        if (NULL == pSeg->pMap) {
+            return false;
+        }
+    }
+    mapUpdate(pSeg->pMap, 0, 2 * words * 64, false);
+    mapUpdate(pSeg->pMap, 0, pSeg->numberOfBlocks, true);
+    if (&cacheMgmt.dirty == pSeg->pList) {
+        mapUpdate(pSeg->pMap + words, 0, pSeg->numberOfBlocks, true);
+    }
+    return true;
+}
+
+void releaseBlockMaps(segment_t *pSeg) {
+    if (pSeg->inlineMap != pSeg->pMap) {
+        free(pSeg->pMap);
+    }
+    pSeg->pMap = NULL;
+}
+
+/**
+ *  @brief  Puts the given segment in the dirty list if any block is dirty, in the LRU list otherwise,
+ *          then recomputes the block counts of the tree
+ *  @param  segment_t *pSeg - a segment in the tree, with bitmaps
+ *          bool refresh - move to the tail of the dirty list even if already in it
+ *  @return None
+ */
+static void settleSegment(segment_t *pSeg, bool refresh) {
+    if (0 != segDirtyBlocks(pSeg)) {
+        if (refresh || (&cacheMgmt.dirty != pSeg->pList)) {
+            removeFromList(pSeg);
+            pushToTail(pSeg, &cacheMgmt.dirty);
+        }
+    } else if (&cacheMgmt.dirty == pSeg->pList) {
+        removeFromList(pSeg);
+        pushToTail(pSeg, &cacheMgmt.lru);
+    }
+    tavlUpdateCounts(&cacheMgmt.tavl, pSeg);
+}
+
+/**
+ *  @brief  Shrinks the LBA range of the given segment in place, keeping its bitmaps in line.
+ *          The key changes without moving the node, as the new range stays between the same neighbors.
+ *  @param  segment_t *pSeg - a segment in the tree
+ *          unsigned head - number of blocks dropped from the start, unsigned numberOfBlocks - blocks kept
+ *  @return None
+ */
+static void trimSegment(segment_t *pSeg, unsigned head, unsigned numberOfBlocks) {
+    unsigned oldWords = mapWords(pSeg->numberOfBlocks);
+    unsigned newWords = mapWords(numberOfBlocks);
+    unsigned i;
+
+    if (NULL != pSeg->pMap) {
+        // Copy in increasing order. The destination never overtakes the source.
+        for (i = 0; i < numberOfBlocks; i++) {
+            mapUpdate(pSeg->pMap, i, i + 1, 0 != mapCount(pSeg->pMap, head + i, head + i + 1));
+        }
+        mapUpdate(pSeg->pMap, numberOfBlocks, newWords * 64, false);
+        for (i = 0; i < numberOfBlocks; i++) {
+            mapUpdate(pSeg->pMap, newWords * 64 + i, newWords * 64 + i + 1,
+                0 != mapCount(pSeg->pMap, oldWords * 64 + head + i, oldWords * 64 + head + i + 1));
+        }
+        mapUpdate(pSeg->pMap, newWords * 64 + numberOfBlocks, 2 * newWords * 64, false);
+    }
+    pSeg->key += head;
+    pSeg->numberOfBlocks = numberOfBlocks;
+}
+
+/**
+ *  @brief  Finds the blocks of the given segment within the given LBA range. Lengths are compared
+ *          rather than ends, so that a range or a segment reaching the top of the LBA space does not wrap around.
+ *  @param  segment_t *pSeg - the segment, unsigned lba - first LBA, unsigned numberOfBlocks - number of blocks
+ *          unsigned *pFrom, unsigned *pTo - set to the offsets of the first block within the range and past the last one
+ *  @return bool - false if no block of the segment is within the range
+ */
+static bool segOverlap(segment_t *pSeg, unsigned lba, unsigned numberOfBlocks, unsigned *pFrom, unsigned *pTo) {
+    if (lba >= pSeg->key) {
+        if (lba - pSeg->key >= pSeg->numberOfBlocks) {
+            return false;
+        }
+        *pFrom = lba - pSeg->key;
+        *pTo = *pFrom + MIN(numberOfBlocks, pSeg->numberOfBlocks - *pFrom);
+    } else {
+        if (pSeg->key - lba >= numberOfBlocks) {
+            return false;
+        }
+        *pFrom = 0;
+        *pTo = MIN(numberOfBlocks - (pSeg->key - lba), pSeg->numberOfBlocks);
+    }
+    return *pFrom < *pTo;
+}
+
+unsigned invalidateBlocks(segment_t *pSeg, unsigned lba, unsigned numberOfBlocks) {
+    unsigned from, to, left;
+
+    // Dropped from the tree while pinned. None of its blocks is cached anymore.
+    if (&cacheMgmt.stale == pSeg->pList) {
+        return 0;
+    }
+    if (false == segOverlap(pSeg, lba, numberOfBlocks, &from, &to)) {
+        return segCachedBlocks(pSeg);
+    }
+    if ((0 == from) && (pSeg->numberOfBlocks == to)) {
+        freeNode(pSeg);
+        return 0;
+    }
+    if ((0 == pSeg->refCount) && (0 == from)) {
+        // The start of the segment - shrink it.
+        trimSegment(pSeg, to, pSeg->numberOfBlocks - to);
+    } else if ((0 == pSeg->refCount) && (pSeg->numberOfBlocks == to)) {
+        // The end of the segment - shrink it.
+        trimSegment(pSeg, 0, from);
+    } else {
+        // A hole in the middle. A pinned segment gets one anywhere, as its extent must not change under its user.
+        if (false == initBlockMaps(pSeg)) {
+            // No memory for the bitmaps. Freeing the whole segment would lose the dirty blocks out of the range.
+            return INVALIDATE_NOMEM;
+        }
+        mapUpdate(pSeg->pMap, from, to, false);
+        mapUpdate(pSeg->pMap + mapWords(pSeg->numberOfBlocks), from, to, false);
+    }
+    left = segCachedBlocks(pSeg);
+    if (0 == left) {
+        freeNode(pSeg);
+        return 0;
+    }
+    if (NULL != pSeg->pMap) {
+        settleSegment(pSeg, false);
+    } else {
+        tavlUpdateCounts(&cacheMgmt.tavl, pSeg);
+    }
+    return left;
+}
+
+bool markBlocksDirty(segment_t *pSeg, unsigned lba, unsigned numberOfBlocks) {
+    unsigned from, to;
+
+    if (false == segOverlap(pSeg, lba, numberOfBlocks, &from, &to)) {
+        return true;
+    }
+
+    // An overwrite of the whole segment does not need bitmaps.
+    if ((NULL == pSeg->pMap) && (0 == from) && (pSeg->numberOfBlocks == to)) {
+        moveToList(pSeg, &cacheMgmt.dirty);
+        return true;
+    }
+    if (false == initBlockMaps(pSeg)) {
+        return false;
+    }
+    mapUpdate(pSeg->pMap, from, to, true);
+    mapUpdate(pSeg->pMap + mapWords(pSeg->numberOfBlocks), from, to, true);
+    settleSegment(pSeg, true);
+    return true;
+}
+
+bool cleanBlocks(segment_t *pSeg, unsigned lba, unsigned numberOfBlocks) {
+    unsigned from, to;
+
+    // Dropped from the tree while being written. Nothing is left to clean.
+    if ((&cacheMgmt.stale == pSeg->pList) || (false == segOverlap(pSeg, lba, numberOfBlocks, &from, &to))) {
+        return true;
+    }
+
+    if ((NULL == pSeg->pMap) && (0 == from) && (pSeg->numberOfBlocks == to)) {
+        if (&cacheMgmt.dirty == pSeg->pList) {
+            moveToList(pSeg, &cacheMgmt.lru);
+        }
+        return true;
+    }
+    if (false == initBlockMaps(pSeg)) {
+        return false;
+    }
+    mapUpdate(pSeg->pMap + mapWords(pSeg->numberOfBlocks), from, to, false);
+    settleSegment(pSeg, false);
+    return true;
+}
+
+bool invalidateRange(unsigned lba, unsigned numberOfBlocks) {
+    tavlScanEntry_t entries[CURSOR_BATCH];
+    tavlCursor_t cursor;
+    unsigned i, n;
+    bool ok = true;
+
+    // Freeing a segment may swap segments between nodes. The cursor copes with it, and the handles
+    // of a batch stay good while earlier ones get freed.
+    tavlCursorInit(&cursor, &cacheMgmt.tavl, lba, numberOfBlocks);
+    while (0 < (n = tavlCursorNext(&cursor, entries, CURSOR_BATCH))) {
+        for (i = 0; i < n; i++) {
+            if (INVALIDATE_NOMEM == invalidateBlocks(entries[i].pSeg, lba, numberOfBlocks)) {
+                ok = false;
+            }
+        }
+    }
+    return ok;
+}
+
+bool cleanRange(unsigned lba, unsigned numberOfBlocks) {
+    tavl_node_t *cNode;
+
+    cNode = searchTavl(cacheMgmt.tavl.root, lba);
+    if (NULL == cNode) {
+        return true;
+    }
+    if (&cacheMgmt.tavl.lowest == cNode) {
+        cNode = cNode->higher;
+    }
+    // Cleaning never frees a segment, so the Thread can be followed as is.
+    for (; (&cacheMgmt.tavl.highest != cNode) && ((cNode->pSeg->key < lba) || (cNode->pSeg->key - lba < numberOfBlocks));
+        cNode = cNode->higher) {
+        if (&cacheMgmt.dirty != cNode->pSeg->pList) {
+            continue;
+        }
+        if (false == cleanBlocks(cNode->pSeg, lba, numberOfBlocks)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ *  @brief  Returns the state of the block at the given offset of the segment
+ *  @param  segment_t *pSeg - the segment, unsigned offset - offset of the block from the key
+ *  @return BLOCK_INVALID, BLOCK_CLEAN or BLOCK_DIRTY
+ */
+static unsigned blockState(segment_t *pSeg, unsigned offset) {
+    uint64_t bit = 1ULL << (offset % 64);
+
+    if (NULL == pSeg->pMap) {
+        return (&cacheMgmt.dirty == pSeg->pList) ? BLOCK_DIRTY : BLOCK_CLEAN;
+    }
+    if (0 == (pSeg->pMap[offset / 64] & bit)) {
+        return BLOCK_INVALID;
+    }
+    return (pSeg->pMap[mapWords(pSeg->numberOfBlocks) + offset / 64] & bit) ? BLOCK_DIRTY : BLOCK_CLEAN;
+}
+
+unsigned blockRun(segment_t *pSeg, unsigned lba, unsigned *pState) {
+    unsigned from, i;
+
+    assert((pSeg->key <= lba) && (lba - pSeg->key < pSeg->numberOfBlocks));
+    from = lba - pSeg->key;
+    if (NULL == pSeg->pMap) {
+        *pState = blockState(pSeg, from);
+        return pSeg->numberOfBlocks - from;
+    }
+    *pState = blockState(pSeg, from);
+    for (i = from + 1; i < pSeg->numberOfBlocks; i++) {
+        if (*pState != blockState(pSeg, i)) {
+            break;
+        }
+    }
+    return i - from;
+}
+
+unsigned absorbWrite(unsigned lba, unsigned numberOfBlocks) {
+    tavl_node_t *cNode;
+    segment_t *pSeg;
+    unsigned n;
+
+    cNode = searchTavl(cacheMgmt.tavl.root, lba);
+    if ((NULL == cNode) || (&cacheMgmt.tavl.lowest == cNode)) {
+        return 0;
+    }
+    pSeg = cNode->pSeg;
+    if ((&cacheMgmt.dirty != pSeg->pList) || (0 != pSeg->refCount) || (lba - pSeg->key >= pSeg->numberOfBlocks)) {
+        return 0;
+    }
+    n = MIN(numberOfBlocks, pSeg->numberOfBlocks - (lba - pSeg->key));
+    if (NULL == pSeg->pMap) {
+        // All blocks are valid and dirty already. Only the age gets refreshed.
+        moveToList(pSeg, &cacheMgmt.dirty);
+    } else {
+        (void)markBlocksDirty(pSeg, lba, n);
+    }
+    return n;
+}
+
+/**
+ *  @brief  Tells whether a pinned segment holds both the block right before the given LBA and the one at it
+ *  @param  unsigned lba - the LBA. 0 also stands for the top of the LBA space, which no segment crosses.
+ *  @return bool - true if a range starting or ending at the LBA would cut a pinned segment in parts
+ */
+static bool pinnedAcross(unsigned lba) {
+    tavl_node_t *cNode = searchTavl(cacheMgmt.tavl.root, lba);
+
+    if ((NULL == cNode) || (&cacheMgmt.tavl.lowest == cNode)) {
+        return false;
+    }
+    return (0 != cNode->pSeg->refCount) && (cNode->pSeg->key < lba) && (cNode->pSeg->numberOfBlocks > lba - cNode->pSeg->key);
+}
+
+bool writeToCache(unsigned lba, unsigned numberOfBlocks) {
+    tavl_node_t *cNode;
+    segment_t *tSeg;
+    unsigned n;
+
+    if (0 == numberOfBlocks) {
+        return true;
+    }
+    // Blocks past the top of the LBA space are dropped.
+    numberOfBlocks = MIN(numberOfBlocks - 1, UINT_MAX - lba) + 1;
+    n = absorbWrite(lba, numberOfBlocks);
+    lba += n;
+    numberOfBlocks -= n;
+    if (0 == numberOfBlocks) {
+        return true;
+    }
+    // A pinned segment, possibly being written to the media, keeps its blocks and its extent. A write cutting
+    // one in parts has to wait till it is unpinned. One entirely overwritten only leaves the tree.
+    if (pinnedAcross(lba) || pinnedAcross(lba + numberOfBlocks)) {
+        return false;
+    }
+    // An overwrite within a single segment flips bits of the segment instead of splitting it.
+    cNode = searchTavl(cacheMgmt.tavl.root, lba);
+    if ((NULL != cNode) && (&cacheMgmt.tavl.lowest != cNode)) {
+        tSeg = cNode->pSeg;
+        if ((lba - tSeg->key < tSeg->numberOfBlocks) && (numberOfBlocks <= tSeg->numberOfBlocks - (lba - tSeg->key)) &&
+            (0 == tSeg->refCount) && markBlocksDirty(tSeg, lba, numberOfBlocks)) {
+            return true;
+        }
+    }
+    tSeg = allocSegment();
+    if (NULL == tSeg) {
+        return false;
+    }
+    // Invalidate only once the segment is there, so that a failed write leaves the overlap alone.
+    if (false == invalidateRange(lba, numberOfBlocks)) {
+        pushToTail(tSeg, &cacheMgmt.free);
+        return false;
+    }
+    initSegment(tSeg);
+    initNode(tSeg->pNode);
+    tSeg->key = lba;
+    tSeg->numberOfBlocks = numberOfBlocks;
+    // In the dirty list first, so that the tree counts it as dirty.
+    pushToTail(tSeg, &cacheMgmt.dirty);
+    cacheMgmt.tavl.root = insertToTavl(&cacheMgmt.tavl, (tavl_node_t *)(tSeg->pNode));
+    return true;
+}
+
+void tavlCursorInit(tavlCursor_t *pCursor, tavl_t *pTavl, unsigned lba, unsigned numberOfBlocks) {
+    pCursor->pTavl = pTavl;
+    pCursor->lba = lba;
+    // The last LBA rather than the end, which would wrap around at the top of the LBA space.
+    pCursor->lastLba = (UINT_MAX == numberOfBlocks) ? UINT_MAX : lba + MIN(numberOfBlocks - 1, UINT_MAX - lba);
+    pCursor->done = (0 == numberOfBlocks);
+}
+
+/**
+ *  @brief  Stacks the given node to be returned after its left subtree, and gets its right subtree
+ *          on the way - by the time the node is popped, it has been in flight for the whole left subtree.
+ *  @param  tavl_node_t **stack - the stack, unsigned *pTop - its depth, tavl_node_t *pNode - the node
+ *  @return None
+ */
+static void cursorPush(tavl_node_t **stack, unsigned *pTop, tavl_node_t *pNode) {
+    assert(CURSOR_DEPTH>*pTop);
+    __builtin_prefetch(pNode->right);
+    stack[(*pTop)++] = pNode;
+}
+
+unsigned tavlCursorNext(tavlCursor_t *pCursor, tavlScanEntry_t *pEntries, unsigned max) {
+    tavl_node_t *stack[CURSOR_DEPTH];
+    tavl_node_t *pNode;
+    segment_t *pSeg;
+    unsigned top = 0, n = 0, i;
+
+    if (pCursor->done) {
+        return 0;
+    }
+    // Descend to the first segment ending after pCursor->lba, stacking the nodes to come back to.
+    // Ends grow along the Thread as segments do not overlap, so this is the first one not returned yet,
+    // whatever happened to the tree since the last call.
+    for (pNode = pCursor->pTavl->root; NULL != pNode; ) {
+        if ((pNode->pSeg->key > pCursor->lba) || (pNode->pSeg->numberOfBlocks > pCursor->lba - pNode->pSeg->key)) {
+            cursorPush(stack, &top, pNode);
+            pNode = pNode->left;
+        } else {
+            pNode = pNode->right;
+        }
+    }
+    // In-order walk, gathering the segments of the batch first. Unlike the Thread, subtrees are independent,
+    // and no segment is read until the whole batch is gathered, so several misses are in flight at once.
+    while ((n < max) && (0 < top)) {
+        pNode = stack[--top];
+        __builtin_prefetch(pNode->pSeg);
+        pEntries[n++].pSeg = pNode->pSeg;
+        for (pNode = pNode->right; NULL != pNode; pNode = pNode->left) {
+            cursorPush(stack, &top, pNode);
+        }
+    }
+    for (i = 0; i < n; i++) {
+        pSeg = pEntries[i].pSeg;
+        if (pSeg->key > pCursor->lastLba) {
+            n = i;
+            break;
+        }
+        pEntries[i].key = pSeg->key;
+        pEntries[i].numberOfBlocks = pSeg->numberOfBlocks;
+        pEntries[i].state = (&cacheMgmt.dirty == pSeg->pList) ? BLOCK_DIRTY : BLOCK_CLEAN;
+    }
+    if (n < max) {
+        pCursor->done = true;
+    }
+    if ((0 < n) && (pEntries[n - 1].numberOfBlocks > UINT_MAX - pEntries[n - 1].key)) {
+        // The last segment returned ends at the top of the LBA space. Nothing can follow it.
+        pCursor->done = true;
+    } else if (0 < n) {
+        // The last segment returned, even if trimmed later, ends at or below this.
+        pCursor->lba = pEntries[n - 1].key + pEntries[n - 1].numberOfBlocks;
+    }
+    return n;
+}
+
+unsigned tavlLookupBlocks(tavl_t *pTavl, unsigned lba, unsigned numberOfBlocks, uint64_t *pHitMap) {
+    tavl_node_t *cNode;
+    segment_t *pSeg;
+    unsigned i, from, to, hits = 0;
+
+    mapUpdate(pHitMap, 0, mapWords(numberOfBlocks) * 64, false);
+    cNode = searchTavl(pTavl->root, lba);
+    if (NULL == cNode) {
+        return 0;
+    }
+    if (&pTavl->lowest == cNode) {
+        cNode = cNode->higher;
+    }
+    while ((&pTavl->highest != cNode) && ((cNode->pSeg->key < lba) || (cNode->pSeg->key - lba < numberOfBlocks))) {
+        pSeg = cNode->pSeg;
+        if (segOverlap(pSeg, lba, numberOfBlocks, &from, &to)) {
+            // Offsets within the segment. The LBAs of the segment do not wrap around, so neither do the LBAs of the range.
+            for (i = from; i < to; i++) {
+                if ((NULL == pSeg->pMap) || (pSeg->pMap[i / 64] & (1ULL << (i % 64)))) {
+                    pHitMap[(pSeg->key + i - lba) / 64] |= 1ULL << ((pSeg->key + i - lba) % 64);
+                    hits++;
+                }
+            }
+        }
+        cNode = cNode->higher;
+    }
+    return hits;
+}
+
+void setRankBalanced(tavl_t *pTavl, bool rankBalanced) {
+	assert(NULL==pTavl->root);
+    pTavl->rankBalanced = rankBalanced;
+}
+
+/**
+ *  @brief  Returns a segment out of the tree to the free list, or to the retired list of its chunk if draining
+ *  @param  segment_t *x - the segment
+ *  @return None
+ */
+static void releaseSegment(segment_t *x) {
+    releaseBlockMaps(x);
     removeFromList(x);
-    pushToTail(x, &cacheMgmt.free);
+    // A segment of a chunk being drained is retired instead of getting reused.
+    if (x->pChunk->draining) {
+        pushToTail(x, &x->pChunk->retired);
+    } else {
+        pushToTail(x, &cacheMgmt.free);
+    }
+}
+
+/**
+ *  @brief  Releases the segments dropped from the tree while pinned that got unpinned since
+ *  @param  None
+ *  @return None
+ */
+static void reapStale(void) {
+    segment_t *pSeg = cacheMgmt.stale.head.next;
+    segment_t *pNext;
+
+    while (&cacheMgmt.stale.tail != pSeg) {
+        pNext = pSeg->next;
+        if (0 == pSeg->refCount) {
+            releaseSegment(pSeg);
+        }
+        pSeg = pNext;
+    }
+}
+
+void freeNode(segment_t *x) {
+    if (0 < x->refCount) {
+        // Whoever pinned it may still be using it, e.g. writing it to the media.
+        // It leaves the tree now, but is not reused till unpinned.
+        removeFromList(x);
+        pushToTail(x, &cacheMgmt.stale);
+    } else {
+        releaseSegment(x);
+    }
 
     // Remove the node from TAVL tree & return the new root
     cacheMgmt.tavl.active_nodes--;
-    cacheMgmt.tavl.root=removeNode(cacheMgmt.tavl.root, x);
+    if (cacheMgmt.tavl.rankBalanced) {
+        cacheMgmt.tavl.root=removeWavlNode(cacheMgmt.tavl.root, x);
+    } else {
+        cacheMgmt.tavl.root=removeNode(cacheMgmt.tavl.root, x);
+    }
+}
+
+bool tavlCountCheck(tavl_node_t *head) {
+    if (NULL == head) {
+        return true;
+    }
+    if ((head->subtreeBlocks != segCachedBlocks(head->pSeg) + subtreeBlocks(head->left) + subtreeBlocks(head->right)) ||
+        (head->subtreeDirty != segDirtyBlocks(head->pSeg) + subtreeDirty(head->left) + subtreeDirty(head->right))) {
+        printf("tavlCountCheck(%p) key:%d, blocks:%d, dirty:%d, left blocks:%d, right blocks:%d\n", head, head->pSeg->key, head->subtreeBlocks, head->subtreeDirty, subtreeBlocks(head->left), subtreeBlocks(head->right));
+        return false;
+    }
+    return tavlCountCheck(head->left) && tavlCountCheck(head->right);
+}
+
+bool wavlRankCheck(tavl_node_t *head) {
+    unsigned dl, dr;
+
+    if (NULL == head) {
+        return true;
+    }
+    if ((NULL==head->left) && (NULL==head->right) && (head->height != 1)) {
+        printf("wavlRankCheck(%p) with key:%d. rank:%d should have been 1\n", head, head->pSeg->key, head->height);
+        return false;
+    }
+    dl = head->height - avlHeight(head->left);
+    dr = head->height - avlHeight(head->right);
+    if ((dl < 1) || (dl > 2) || (dr < 1) || (dr > 2)) {
+        printf("wavlRankCheck(%p) rank:%d, key:%d, left rank:%d, right rank:%d\n", head, head->height, head->pSeg->key, avlHeight(head->left), avlHeight(head->right));
+        return false;
+    }
+    return wavlRankCheck(head->left) && wavlRankCheck(head->right);
+}
+
+void setWatermarks(unsigned low, unsigned high) {
+	assert(low<=high);
+    cacheMgmt.lowWatermark = low;
+    cacheMgmt.highWatermark = high;
+    cacheMgmt.reclaiming = false;
+}
+
+void setPoolPlacement(unsigned pageSize, bool bind, unsigned numaNode) {
+	assert(POOL_PAGE_1G>=pageSize);
+    cacheMgmt.placement.pageSize = pageSize;
+    cacheMgmt.placement.bind = bind;
+    cacheMgmt.placement.numaNode = numaNode;
+}
+
+/**
+ *  @brief  Tells whether the given segment can be evicted - neither pinned nor holding dirty blocks
+ *  @param  segment_t *pSeg - a segment in the tree
+ *  @return bool - true if the segment can be freed
+ */
+static bool evictable(segment_t *pSeg) {
+    return (0 == pSeg->refCount) && (0 == segDirtyBlocks(pSeg));
+}
+
+unsigned reclaimCache(unsigned batch) {
+    segment_t *pSeg, *pNext;
+    unsigned evicted = 0;
+
+    reapStale();
+    // Hysteresis - start below the low watermark, keep going till the high watermark.
+    if (cacheMgmt.free.count < cacheMgmt.lowWatermark) {
+        cacheMgmt.reclaiming = true;
+    }
+    if (false == cacheMgmt.reclaiming) {
+        return 0;
+    }
+    pSeg = cacheMgmt.lru.head.next;
+    while ((0 < batch) && (&cacheMgmt.lru.tail != pSeg)) {
+        if (cacheMgmt.free.count >= cacheMgmt.highWatermark) {
+            break;
+        }
+        pNext = pSeg->next;
+        // Pinned segments, and ones with dirty blocks left, stay where they are. The next one in age is examined instead.
+        // Only evictions count against the batch, so a pinned head of the list cannot stall reclaim.
+        if (evictable(pSeg)) {
+            freeNode(pSeg);
+            evicted++;
+            batch--;
+        }
+        pSeg = pNext;
+    }
+    if (cacheMgmt.free.count >= cacheMgmt.highWatermark) {
+        cacheMgmt.reclaiming = false;
+    }
+    return evicted;
+}
+
+segment_t *allocSegment(void) {
+    segment_t *pSeg, *pNext;
+
+    reapStale();
+    pSeg = popFromHead(&cacheMgmt.free);
+    if (NULL != pSeg) {
+        return pSeg;
+    }
+    // Reclaim fell behind. Evict the oldest unpinned segment in the foreground.
+    pSeg = cacheMgmt.lru.head.next;
+    while (&cacheMgmt.lru.tail != pSeg) {
+        pNext = pSeg->next;
+        if (evictable(pSeg)) {
+            freeNode(pSeg);
+            // A segment of a draining chunk is retired rather than freed. Keep evicting.
+            pSeg = popFromHead(&cacheMgmt.free);
+            if (NULL != pSeg) {
+                return pSeg;
+            }
+        }
+        pSeg = pNext;
+    }
+    return NULL;
+}
+
+void replaceNode(tavl_t *pTavl, tavl_node_t *pOld, tavl_node_t *pNew) {
+    tavl_node_t **ppLink = &pTavl->root;
+    unsigned key = pOld->pSeg->key;
+
+    // Find the link pointing to the old node.
+    while (*ppLink != pOld) {
+		assert(NULL!=*ppLink);
+        if (key < (*ppLink)->pSeg->key) {
+            ppLink = &(*ppLink)->left;
+        } else {
+            ppLink = &(*ppLink)->right;
+        }
+    }
+    *pNew = *pOld;
+    *ppLink = pNew;
+    pNew->lower->higher = pNew;
+    pNew->higher->lower = pNew;
+    initNode(pOld);
+}
+
+/**
+ *  @brief  Checks whether the given node belongs to the given chunk
+ *  @param  poolChunk_t *pChunk - the chunk, tavl_node_t *pNode - the node
+ *  @return bool - true if the node is in the chunk
+ */
+static bool isChunkNode(poolChunk_t *pChunk, tavl_node_t *pNode) {
+    return (pNode >= pChunk->pNodes) && (pNode < pChunk->pNodes + pChunk->numOfNodes);
+}
+
+poolChunk_t *growCache(unsigned numOfNodes) {
+    poolChunk_t *pChunk, **ppLast;
+    unsigned i;
+
+    pChunk = malloc(sizeof(poolChunk_t));
+    if (NULL == pChunk) {
+        return NULL;
+    }
+    pChunk->pSegments = poolAlloc(numOfNodes*sizeof(segment_t), &cacheMgmt.placement, &pChunk->segmentsMapping);
+    pChunk->pNodes = poolAlloc(numOfNodes*sizeof(tavl_node_t), &cacheMgmt.placement, &pChunk->nodesMapping);
+    if ((NULL == pChunk->pSegments) || (NULL == pChunk->pNodes)) {
+        poolFree(pChunk->pSegments, &pChunk->segmentsMapping);
+        poolFree(pChunk->pNodes, &pChunk->nodesMapping);
+        free(pChunk);
+        return NULL;
+    }
+    pChunk->next = NULL;
+    pChunk->numOfNodes = numOfNodes;
+    pChunk->draining = false;
+    pChunk->drainCursor = 0;
+    pChunk->relocCursor = 0;
+    pChunk->pSpare = NULL;
+    initSegment(&pChunk->retired.head);
+    initSegment(&pChunk->retired.tail);
+    pChunk->retired.head.next=&pChunk->retired.tail;
+    pChunk->retired.tail.prev=&pChunk->retired.head;
+    pChunk->retired.count = 0;
+
+    for (i = 0; i < numOfNodes; i++) {
+        initSegment(&pChunk->pSegments[i]);
+        initNode(&pChunk->pNodes[i]);
+        pChunk->pNodes[i].pSeg=&pChunk->pSegments[i];
+        pChunk->pSegments[i].pNode=(void *)&pChunk->pNodes[i];
+        pChunk->pSegments[i].pChunk=pChunk;
+        pushToTail(&pChunk->pSegments[i], &cacheMgmt.free);
+    }
+
+    // Append to the chunk list so pSegmentPool keeps pointing at the first chunk.
+    ppLast = &cacheMgmt.chunks;
+    while (NULL != *ppLast) {
+        ppLast = &(*ppLast)->next;
+    }
+    *ppLast = pChunk;
+    cacheMgmt.numOfNodes += numOfNodes;
+    return pChunk;
+}
+
+void shrinkCache(poolChunk_t *pChunk) {
+	assert(NULL!=pChunk);
+    pChunk->draining = true;
+    pChunk->drainCursor = 0;
+    pChunk->relocCursor = 0;
+    pChunk->pSpare = NULL;
+}
+
+/**
+ *  @brief  Unlinks the fully drained chunk from the pool and frees it
+ *  @param  poolChunk_t *pChunk - the chunk
+ *  @return None
+ */
+static void releaseChunk(poolChunk_t *pChunk) {
+    poolChunk_t **ppLink = &cacheMgmt.chunks;
+
+    while (*ppLink != pChunk) {
+		assert(NULL!=*ppLink);
+        ppLink = &(*ppLink)->next;
+    }
+    *ppLink = pChunk->next;
+    cacheMgmt.numOfNodes -= pChunk->numOfNodes;
+    if (NULL == cacheMgmt.chunks) {
+        pSegmentPool = NULL;
+        pNodePool = NULL;
+    } else {
+        pSegmentPool = cacheMgmt.chunks->pSegments;
+        pNodePool = cacheMgmt.chunks->pNodes;
+    }
+    poolFree(pChunk->pSegments, &pChunk->segmentsMapping);
+    poolFree(pChunk->pNodes, &pChunk->nodesMapping);
+    free(pChunk);
+}
+
+bool drainChunk(poolChunk_t *pChunk, unsigned budget) {
+    segment_t *pSeg, *pHolder;
+    tavl_node_t *pNode, *pSpareNode;
+
+	assert(pChunk->draining);
+    while (0 < budget) {
+        budget--;
+        if (pChunk->retired.count < pChunk->numOfNodes) {
+            // 1. Retire each segment of the chunk, sweeping over the chunk till all are retired.
+            pSeg = &pChunk->pSegments[pChunk->drainCursor];
+            pChunk->drainCursor = (pChunk->drainCursor + 1) % pChunk->numOfNodes;
+            if (&cacheMgmt.free == pSeg->pList) {
+                removeFromList(pSeg);
+                pushToTail(pSeg, &pChunk->retired);
+            } else if ((&cacheMgmt.stale == pSeg->pList) && (0 == pSeg->refCount)) {
+                releaseSegment(pSeg);
+            } else if (((&cacheMgmt.lru == pSeg->pList) || (&cacheMgmt.locked == pSeg->pList)) && evictable(pSeg)) {
+                // freeNode() retires it.
+                freeNode(pSeg);
+            }
+            // Dirty, pinned (in the tree or not) and allocated segments are revisited later.
+            continue;
+        }
+        if (pChunk->relocCursor < pChunk->numOfNodes) {
+            // 2. All segments are retired, but segments of other chunks may still hold nodes of this chunk.
+            //    Hand each of them a node of other chunks held by a retired segment.
+            pNode = &pChunk->pNodes[pChunk->relocCursor];
+            pChunk->relocCursor++;
+            pHolder = pNode->pSeg;
+            if (pHolder->pChunk == pChunk) {
+                continue;
+            }
+            if (NULL == pChunk->pSpare) {
+                pChunk->pSpare = pChunk->retired.head.next;
+            }
+            while (isChunkNode(pChunk, (tavl_node_t *)(pChunk->pSpare->pNode))) {
+                pChunk->pSpare = pChunk->pSpare->next;
+				assert(&pChunk->retired.tail!=pChunk->pSpare);
+            }
+            pSpareNode = (tavl_node_t *)(pChunk->pSpare->pNode);
+            if (NULL != pNode->lower) {
+                replaceNode(&cacheMgmt.tavl, pNode, pSpareNode);
+            }
+            pSpareNode->pSeg = pHolder;
+            pHolder->pNode = (void *)pSpareNode;
+            pNode->pSeg = pChunk->pSpare;
+            pChunk->pSpare->pNode = (void *)pNode;
+            continue;
+        }
+        // 3. Nothing of the chunk is in use anymore.
+        releaseChunk(pChunk);
+        return true;
+    }
+    return false;
 }
 
 tavl_node_t *dumpPathToKey(tavl_node_t *head, unsigned lba) {
@@ -377,6 +1650,8 @@ void tavlSanityCheck(tavl_t *pTavl) {
     }
     // Check if the active_nodes matches with the number of nodes traversed.
 	assert(pTavl->active_nodes==i);
+    // Check the block counts of the tree.
+	assert(tavlCountCheck(pTavl->root));
 }
 
 bool tavlHeightCheck(tavl_node_t *head) {
@@ -413,17 +1688,24 @@ bool tavlHeightCheck(tavl_node_t *head) {
 	return true;
 }
 
+void initTavl(tavl_t *pTavl) {
+    pTavl->root = NULL;
+    pTavl->active_nodes = 0;
+    pTavl->rankBalanced = false;
+    initNode(&pTavl->lowest);
+    initNode(&pTavl->highest);
+    pTavl->lowest.pSeg = NULL;
+    pTavl->highest.pSeg = NULL;
+    pTavl->lowest.higher=&pTavl->highest;
+    pTavl->highest.lower=&pTavl->lowest;
+}
+
 void initCache(int maxNode) {
-    unsigned i;
+    poolChunk_t *pChunk;
 
     // Initialize cache management data structure
     // 1. Initialize cacheMgmt.
-    cacheMgmt.tavl.root = NULL;
-    cacheMgmt.tavl.active_nodes = 0;
-    initNode(&cacheMgmt.tavl.lowest);
-    initNode(&cacheMgmt.tavl.highest);
-    cacheMgmt.tavl.lowest.higher=&cacheMgmt.tavl.highest;
-    cacheMgmt.tavl.highest.lower=&cacheMgmt.tavl.lowest;
+    initTavl(&cacheMgmt.tavl);
     initSegment(&cacheMgmt.locked.head);
     initSegment(&cacheMgmt.locked.tail);
     cacheMgmt.locked.head.next=&cacheMgmt.locked.tail;
@@ -440,17 +1722,25 @@ void initCache(int maxNode) {
     initSegment(&cacheMgmt.free.tail);
     cacheMgmt.free.head.next=&cacheMgmt.free.tail;
     cacheMgmt.free.tail.prev=&cacheMgmt.free.head;
+    initSegment(&cacheMgmt.stale.head);
+    initSegment(&cacheMgmt.stale.tail);
+    cacheMgmt.stale.head.next=&cacheMgmt.stale.tail;
+    cacheMgmt.stale.tail.prev=&cacheMgmt.stale.head;
+    cacheMgmt.locked.count = 0;
+    cacheMgmt.lru.count = 0;
+    cacheMgmt.dirty.count = 0;
+    cacheMgmt.free.count = 0;
+    cacheMgmt.stale.count = 0;
+    // Reclaim is disabled till setWatermarks() is called.
+    cacheMgmt.lowWatermark = 0;
+    cacheMgmt.highWatermark = 0;
+    cacheMgmt.reclaiming = false;
 
-    // 2. Initialize each segment and push into cacheMgmt.free.
-	pSegmentPool=malloc(maxNode*sizeof(segment_t));
-	pNodePool=malloc(maxNode*sizeof(tavl_node_t));
-	assert(NULL!=pSegmentPool);
-	assert(NULL!=pNodePool);
-    for (i = 0; i < maxNode; i++) {
-        initSegment(&pSegmentPool[i]);
-        initNode(&pNodePool[i]);
-        pNodePool[i].pSeg=&pSegmentPool[i];
-        pSegmentPool[i].pNode=(void *)&pNodePool[i];
-        pushToTail(&pSegmentPool[i], &cacheMgmt.free);
-    }
+    // 2. Allocate the first pool chunk. Each segment gets initialized and pushed into cacheMgmt.free.
+    cacheMgmt.chunks = NULL;
+    cacheMgmt.numOfNodes = 0;
+    pChunk = growCache(maxNode);
+	assert(NULL!=pChunk);
+    pSegmentPool = pChunk->pSegments;
+    pNodePool = pChunk->pNodes;
 }
@@ -2,23 +2,51 @@
 #define __TAVL_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include "pool.h"
 
 //-----------------------------------------------------------
 // Macros
 //-----------------------------------------------------------
 #define MAX(x,y) (((x) >= (y)) ? (x) : (y))
 #define MIN(x,y) (((x) >= (y)) ? (y) : (x))
+// Block states reported by blockRun()
+#define BLOCK_INVALID       (0)
+#define BLOCK_CLEAN         (1)
+#define BLOCK_DIRTY         (2)
+// Returned by invalidateBlocks() when a segment could not get the bitmaps for a hole
+#define INVALIDATE_NOMEM    (UINT_MAX)
+#define CURSOR_DEPTH        (64)    // Nodes stacked by a cursor at most, the height of a WAVL tree of 2^32 nodes
+#define CURSOR_BATCH        (16)    // Entries taken at a time by the scans of the cache itself
+// Segments with up to this many blocks keep their validity/dirty bitmaps inline
+#define SEG_INLINE_BLOCKS   (64)
 
 //-----------------------------------------------------------
 // Structure definitions
 //-----------------------------------------------------------
+struct segList;
+struct poolChunk;
+
 typedef struct segment {
     // Previous and Next pointer used for Locked/LRU/Dirty/Free list
     struct segment  *prev;
     struct segment  *next;
+    // The list the segment is currently in, or NULL
+    struct segList  *pList;
     void            *pNode;
     unsigned        key;
     unsigned        numberOfBlocks;
+    // Number of users holding the segment. A pinned segment (refCount>0) is never reclaimed.
+    // If invalidated, it leaves the tree but waits in cacheMgmt.stale till unpinned.
+    unsigned        refCount;
+    // The pool chunk the segment was allocated from
+    struct poolChunk *pChunk;
+    // Validity and dirty bitmaps, one bit per block. NULL while the whole segment is valid,
+    // in which case the whole segment is dirty if it is in the dirty list.
+    // Otherwise points at the valid words followed by the same number of dirty words.
+    uint64_t        *pMap;
+    uint64_t        inlineMap[2];
 } segment_t;
 
 typedef struct tavl_node {
@@ -30,34 +58,89 @@ typedef struct tavl_node {
     struct tavl_node  *higher;
     segment_t       *pSeg;
     unsigned        height;
+    // Number of cached and dirty blocks in the sub-tree rooted at this node
+    unsigned        subtreeBlocks;
+    unsigned        subtreeDirty;
 } tavl_node_t;
 
 typedef struct segList {
     segment_t   head;
     segment_t   tail;
+    unsigned    count;
 } segList_t;
 
+// Segments and nodes are allocated in chunks so the pool can grow and shrink at runtime.
+// Note that removeNode() swaps segments between nodes, thus a segment does not necessarily
+// use a node from its own chunk.
+typedef struct poolChunk {
+    struct poolChunk    *next;
+    segment_t           *pSegments;
+    tavl_node_t         *pNodes;
+    unsigned            numOfNodes;
+    // Drain state - see shrinkCache() and drainChunk()
+    bool                draining;
+    unsigned            drainCursor;
+    unsigned            relocCursor;
+    segment_t           *pSpare;
+    segList_t           retired;
+    // How pSegments and pNodes got allocated - see setPoolPlacement()
+    poolMapping_t       segmentsMapping;
+    poolMapping_t       nodesMapping;
+} poolChunk_t;
+
 typedef struct tavl {
     tavl_node_t *root;
     tavl_node_t lowest;
     tavl_node_t highest;
     int         active_nodes;
+    // true if the tree is rank-balanced (WAVL) instead of AVL. height holds the rank + 1 then.
+    bool        rankBalanced;
 } tavl_t;
 
+// An entry filled in by tavlCursorNext()
+typedef struct tavlScanEntry {
+    unsigned    key;
+    unsigned    numberOfBlocks;
+    unsigned    state;          // BLOCK_DIRTY if any block of the segment is dirty, BLOCK_CLEAN otherwise
+    segment_t   *pSeg;          // handle, valid till the segment is freed
+} tavlScanEntry_t;
+
+// Position of a scan in LBA order. Only LBAs are kept, so the tree may change between steps.
+typedef struct tavlCursor {
+    tavl_t      *pTavl;
+    unsigned    lba;            // the next segment returned is the first one ending after this LBA
+    unsigned    lastLba;        // the scan stops at segments starting after this LBA
+    bool        done;
+} tavlCursor_t;
+
 typedef struct cManagement {
 	tavl_t		tavl;
     segList_t   locked;
     segList_t   lru;
     segList_t   dirty;
     segList_t   free;
+    // Segments dropped from the tree while pinned, released by allocSegment() and reclaimCache() once unpinned
+    segList_t   stale;
+    // Free list watermarks used by reclaimCache()
+    unsigned    lowWatermark;
+    unsigned    highWatermark;
+    bool        reclaiming;
+    // Pool chunks, the first one being allocated by initCache()
+    poolChunk_t *chunks;
+    unsigned    numOfNodes;
+    // Page size and NUMA node of chunks allocated from now on. Kept across initCache().
+    poolPlacement_t placement;
 } cManagement_t;
 
 //-----------------------------------------------------------
 // Global variables
 //-----------------------------------------------------------
+// Segment and node arrays of the first pool chunk
 extern  segment_t       *pSegmentPool;
 extern	tavl_node_t     *pNodePool;
 extern  cManagement_t   cacheMgmt;
+// Number of single rotations done so far. A double rotation counts as two.
+extern  unsigned long   tavlRotations;
 
 
 //-----------------------------------------------------------
@@ -84,6 +167,17 @@ extern	void initNode(tavl_node_t *pNode);
  */
 extern void pushToTail(segment_t *pSeg, segList_t *pList);
 
+/**
+ *  @brief  Moves the given segment from its current list, if any, to the tail of the given list.
+ *          Segments in the TAVL tree need to change list through this function,
+ *          so that the dirty block counts of the tree are kept up to date.
+ *          The dirty bitmap, if any, follows the list - all valid blocks become dirty in the dirty list
+ *          and clean in the LRU list. settleSegment() is the way to go from the bitmap to the list instead.
+ *  @param  segment_t *pSeg - the segment to be moved, segList_t *pList - the destination list
+ *  @return None
+ */
+extern void moveToList(segment_t *pSeg, segList_t *pList);
+
 /**
  *  @brief  Removes the given segment from any list - Locked, LRU, Dirty or Free
  *          Note that the function does not need to know which list the segment is removed from
@@ -160,6 +254,16 @@ extern tavl_node_t *insertNode(tavl_node_t *head, tavl_node_t *x);
  */
 extern tavl_node_t *removeNode(tavl_node_t *head, segment_t *x);
 
+/**
+ *  @brief  Removes the given segment from the given WAVL (rank-balanced) tree
+ *          Same as removeNode(), but rebalances by the WAVL rank rule,
+ *          which takes at most two rotations per removal.
+ *  @param  tavl_node_t *head - a node in the WAVL tree, or NULL
+ *          segment_t *x - a segment to be removed
+ *  @return root of the new tree
+ */
+extern tavl_node_t *removeWavlNode(tavl_node_t *head, segment_t *x);
+
 /**
  *  @brief  Searches the given AVL tree for the given key
  *  @param  tavl_node_t *head - a node in the AVL tree, or NULL
@@ -176,6 +280,17 @@ extern tavl_node_t *searchAvl(tavl_node_t *head, unsigned key);
  */
 extern tavl_node_t *searchTavl(tavl_node_t *head, unsigned lba);
 
+/**
+ *  @brief  Inserts the given node into the given TAVL tree that is NOT empty.
+ *          In other words,
+ *          1. inserts the given node into AVL tree
+ *          2. inserts the given node into the Thread
+ *  @param  tavl_node_t *head - root of the tree,
+ *          tavl_node_t *x - pointer to the node to be inserted
+ *  @return New root of the tree
+ */
+extern tavl_node_t *_insertToTavl(tavl_node_t *head, tavl_node_t *x);
+
 /**
  *  @brief  Inserts the given node into the given TAVL tree.
  *          In other words,
@@ -187,11 +302,177 @@ extern tavl_node_t *searchTavl(tavl_node_t *head, unsigned lba);
  */
 extern tavl_node_t *insertToTavl(tavl_t *pTavl, tavl_node_t *x);
 
+/**
+ *  @brief  Recomputes the block counts on the path from the root to the node of the given segment.
+ *          Needs to be called once the number of cached or dirty blocks of a segment in the tree changes.
+ *  @param  tavl_t *pTavl - pointer to the tavl structure
+ *          segment_t *x - a segment in the tree
+ *  @return None
+ */
+extern void tavlUpdateCounts(tavl_t *pTavl, segment_t *x);
+
+/**
+ *  @brief  Enables the validity and dirty bitmaps of the given segment, starting with all blocks valid,
+ *          and all blocks dirty if the segment is in the dirty list.
+ *          Segments of up to SEG_INLINE_BLOCKS blocks keep the bitmaps inline, larger ones allocate them.
+ *          Once enabled, the functions below move the segment between the dirty and the LRU list
+ *          depending on whether any block is dirty.
+ *  @param  segment_t *pSeg - the segment
+ *  @return bool - false if the bitmaps could not be allocated
+ */
+extern bool initBlockMaps(segment_t *pSeg);
+
+/**
+ *  @brief  Drops the validity and dirty bitmaps of the given segment
+ *  @param  segment_t *pSeg - the segment
+ *  @return None
+ */
+extern void releaseBlockMaps(segment_t *pSeg);
+
+/**
+ *  @brief  Invalidates the blocks of the given segment that are within the given LBA range,
+ *          without restructuring the tree. The segment is shrunk in place if the range covers
+ *          its start or its end, and gets a hole in its validity bitmap otherwise.
+ *          A pinned segment keeps its extent and gets a hole in any case.
+ *          The segment is freed once no valid block is left.
+ *  @param  segment_t *pSeg - a segment in the tree. One dropped from the tree while pinned is left as is.
+ *          unsigned lba - first LBA, unsigned numberOfBlocks - number of blocks
+ *  @return Number of valid blocks left in the segment. If 0, the segment got freed,
+ *          or had been dropped from the tree already.
+ *          INVALIDATE_NOMEM if the bitmaps for a hole could not be allocated. The segment is left as is then.
+ */
+extern unsigned invalidateBlocks(segment_t *pSeg, unsigned lba, unsigned numberOfBlocks);
+
+/**
+ *  @brief  Marks the blocks of the given segment that are within the given LBA range as valid and dirty,
+ *          as done by an overwrite, and moves the segment to the tail of the dirty list.
+ *  @param  segment_t *pSeg - a segment in the tree
+ *          unsigned lba - first LBA, unsigned numberOfBlocks - number of blocks
+ *  @return bool - false if the bitmaps could not be allocated
+ */
+extern bool markBlocksDirty(segment_t *pSeg, unsigned lba, unsigned numberOfBlocks);
+
+/**
+ *  @brief  Marks the blocks of the given segment that are within the given LBA range as clean,
+ *          as done once written to the media. The segment moves to the LRU list once no dirty block is left.
+ *  @param  segment_t *pSeg - a segment in the tree. One dropped from the tree while pinned is left as is.
+ *          unsigned lba - first LBA, unsigned numberOfBlocks - number of blocks
+ *  @return bool - false if the bitmaps could not be allocated
+ */
+extern bool cleanBlocks(segment_t *pSeg, unsigned lba, unsigned numberOfBlocks);
+
+/**
+ *  @brief  Invalidates all cached blocks within the given LBA range, for coherency.
+ *          Segments fully within the range are freed, the others keep their blocks out of the range.
+ *          Afterwards, no segment overlaps the range unless one spans the whole range or is pinned.
+ *          Pinned segments keep their extent, with holes in their bitmaps.
+ *  @param  unsigned lba - first LBA, unsigned numberOfBlocks - number of blocks
+ *  @return bool - false if a segment could not get the bitmaps for a hole. It keeps all its blocks then.
+ */
+extern bool invalidateRange(unsigned lba, unsigned numberOfBlocks);
+
+/**
+ *  @brief  Marks all dirty blocks within the given LBA range as clean, as done once they are written to the media.
+ *          Segments with no dirty block left move to the LRU list.
+ *  @param  unsigned lba - first LBA, unsigned numberOfBlocks - number of blocks
+ *  @return bool - false if the bitmaps of a segment could not be allocated
+ */
+extern bool cleanRange(unsigned lba, unsigned numberOfBlocks);
+
+/**
+ *  @brief  Returns the length of the run of blocks in the same state, starting at the given LBA of the segment
+ *  @param  segment_t *pSeg - the segment, unsigned lba - an LBA within the range of the segment
+ *          unsigned *pState - set to BLOCK_INVALID, BLOCK_CLEAN or BLOCK_DIRTY
+ *  @return Number of blocks in the run
+ */
+extern unsigned blockRun(segment_t *pSeg, unsigned lba, unsigned *pState);
+
+/**
+ *  @brief  Absorbs a write into the dirty segment holding its first LBA, if any.
+ *          The blocks are marked dirty in place and the segment moves to the tail of the dirty list.
+ *          The tree is not touched. Pinned segments, possibly being written to the media, are left alone.
+ *  @param  unsigned lba - first LBA, unsigned numberOfBlocks - number of blocks
+ *  @return Number of blocks absorbed from the start of the write, 0 if none
+ */
+extern unsigned absorbWrite(unsigned lba, unsigned numberOfBlocks);
+
+/**
+ *  @brief  Write path. Absorbs the write into an existing dirty segment as far as possible.
+ *          The rest is written into the segment spanning it if any, otherwise any overlap is invalidated
+ *          and a new segment is inserted into the tree and the dirty list.
+ *          A pinned segment entirely overwritten leaves the tree, but one is never cut in parts.
+ *  @param  unsigned lba - first LBA, unsigned numberOfBlocks - number of blocks. Blocks past UINT_MAX are dropped.
+ *  @return bool - false if no segment could be allocated for the part not absorbed,
+ *          a segment could not get the bitmaps for a hole, or the write would cut a pinned segment.
+ *          The part absorbed stays written. The write may be retried as a whole, e.g. once the segment is unpinned.
+ */
+extern bool writeToCache(unsigned lba, unsigned numberOfBlocks);
+
+/**
+ *  @brief  Starts a scan of the segments overlapping the given LBA range, in LBA order
+ *  @param  tavlCursor_t *pCursor - the cursor, tavl_t *pTavl - the tree
+ *          unsigned lba - first LBA, unsigned numberOfBlocks - number of blocks, clamped at the top of
+ *          the LBA space. UINT_MAX scans to the end, LBA UINT_MAX included.
+ *  @return None
+ */
+extern void tavlCursorInit(tavlCursor_t *pCursor, tavl_t *pTavl, unsigned lba, unsigned numberOfBlocks);
+
+/**
+ *  @brief  Fills in the next segments of the scan. The tree is walked in order rather than the Thread,
+ *          prefetching right subtrees, and the segments of the whole batch are gathered before any is read.
+ *          The tree may change between calls. The scan resumes from the first segment ending after the
+ *          last one returned, so segments inserted behind the cursor are not returned.
+ *          Meant for the cache tree, where segments do not overlap.
+ *          The entries of a call may be invalidated while going through them - freeing the segment of
+ *          one entry does not affect the handles of the others.
+ *  @param  tavlCursor_t *pCursor - the cursor
+ *          tavlScanEntry_t *pEntries - filled in, unsigned max - number of entries available
+ *  @return Number of entries filled in, 0 at the end of the scan
+ */
+extern unsigned tavlCursorNext(tavlCursor_t *pCursor, tavlScanEntry_t *pEntries, unsigned max);
+
+/**
+ *  @brief  Looks up an LBA range and reports the hits at block granularity
+ *  @param  tavl_t *pTavl - pointer to the tavl structure
+ *          unsigned lba - first LBA, unsigned numberOfBlocks - number of blocks
+ *          uint64_t *pHitMap - (numberOfBlocks+63)/64 words. Bit i is set if LBA lba+i is a valid cached block.
+ *  @return Number of hit blocks
+ */
+extern unsigned tavlLookupBlocks(tavl_t *pTavl, unsigned lba, unsigned numberOfBlocks, uint64_t *pHitMap);
+
+/**
+ *  @brief  Counts the cached and dirty blocks within an LBA window, in O(log n)
+ *  @param  tavl_t *pTavl - pointer to the tavl structure
+ *          unsigned lba - first LBA of the window, unsigned numberOfBlocks - size of the window, clamped at UINT_MAX
+ *          unsigned *pCached - number of cached blocks in the window, unsigned *pDirty - number of dirty ones
+ *  @return None
+ */
+extern void tavlRangeCount(tavl_t *pTavl, unsigned lba, unsigned numberOfBlocks, unsigned *pCached, unsigned *pDirty);
+
+/**
+ *  @brief  Finds the n-th cached block in LBA order, in O(log n)
+ *  @param  tavl_t *pTavl - pointer to the tavl structure
+ *          unsigned n - 0 based rank of the block
+ *          unsigned *pLba - LBA of the block
+ *  @return The node holding the block, or NULL if there are no more than n cached blocks
+ */
+extern tavl_node_t *tavlSelectBlock(tavl_t *pTavl, unsigned n, unsigned *pLba);
+
+/**
+ *  @brief  Selects WAVL (rank-balanced) instead of AVL rebalancing for the given TAVL tree.
+ *          The tree must be empty.
+ *  @param  tavl_t *pTavl - pointer to the tavl structure
+ *          bool rankBalanced - true for WAVL, false for AVL
+ *  @return None
+ */
+extern void setRankBalanced(tavl_t *pTavl, bool rankBalanced);
+
 // Remove a node from AVL tree, thread and list the push to free list.
 // Specified list can be Locked/LRU/Dirty.
 // Returns the new root.
 /**
  *  @brief  Remove a segment_t from cache management TAVL tree then push to the free list.
+ *          A pinned segment goes to cacheMgmt.stale instead, keeping its bitmaps, till unpinned.
  *  @param  segment_t *x - segment to be removed
  *  @return None
  */
@@ -219,6 +500,107 @@ extern void tavlSanityCheck(tavl_t *pTavl);
  */
 extern bool tavlHeightCheck(tavl_node_t *head);
 
+/**
+ *  @brief  Checks the block counts of all nodes under the given node
+ *  @param  tavl_node_t *head - a node in the tree, or NULL
+ *  @return bool - true if block counts are correct
+ */
+extern bool tavlCountCheck(tavl_node_t *head);
+
+/**
+ *  @brief  Checks the rank rule of all nodes under the given node of a WAVL tree.
+ *          Each rank difference is 1 or 2 and each leaf has rank 1.
+ *  @param  tavl_node_t *head - a node in the WAVL tree, or NULL
+ *  @return bool - true if ranks are correct
+ */
+extern bool wavlRankCheck(tavl_node_t *head);
+
+/**
+ *  @brief  Sets the free list watermarks used by reclaimCache().
+ *          Reclaim starts when the free list drops below the low watermark
+ *          and stops once the free list reaches the high watermark.
+ *  @param  unsigned low - low watermark, unsigned high - high watermark
+ *  @return None
+ */
+extern void setWatermarks(unsigned low, unsigned high);
+
+/**
+ *  @brief  Sets the page size and NUMA node of the pool chunks allocated from now on,
+ *          including the first one if called before initCache().
+ *          Chunks already allocated stay where they are.
+ *  @param  unsigned pageSize - POOL_PAGE_*
+ *          bool bind - true to prefer the given NUMA node, unsigned numaNode - the node
+ *  @return None
+ */
+extern void setPoolPlacement(unsigned pageSize, bool bind, unsigned numaNode);
+
+/**
+ *  @brief  Runs one reclaim step. Evicts unpinned segments from the head of the LRU list
+ *          till the free list reaches the high watermark or the batch is exhausted.
+ *          Dirty and locked segments are never in the LRU list, thus never evicted.
+ *          Nor is a segment with dirty blocks left in its bitmap, whatever its list.
+ *          Segments dropped from the tree while pinned are released first, if unpinned since.
+ *          Meant to be polled from an idle loop or a background context so that
+ *          eviction stays out of the insert path.
+ *  @param  unsigned batch - maximum number of segments to evict. Unevictable ones are passed over
+ *          without counting, up to the tail of the LRU list.
+ *  @return Number of segments evicted
+ */
+extern unsigned reclaimCache(unsigned batch);
+
+/**
+ *  @brief  Pops a segment from the free list, after releasing the ones dropped from the tree while pinned
+ *          and unpinned since. If the free list is empty, synchronously evicts the oldest unpinned LRU segment.
+ *  @param  None
+ *  @return The segment, or NULL if nothing could be evicted
+ */
+extern segment_t *allocSegment(void);
+
+/**
+ *  @brief  Replaces a node in the TAVL tree and the Thread with another node that is not in the tree.
+ *          The segment keeps its position, only the node holding it changes.
+ *          The caller needs to relink the segment with the new node.
+ *  @param  tavl_t *pTavl - pointer to the tavl structure
+ *          tavl_node_t *pOld - node in the tree, tavl_node_t *pNew - node to take its place
+ *  @return None
+ */
+extern void replaceNode(tavl_t *pTavl, tavl_node_t *pOld, tavl_node_t *pNew);
+
+/**
+ *  @brief  Adds a chunk of segments and nodes to the pool at runtime and pushes the segments to the free list.
+ *  @param  unsigned numOfNodes - number of segments and nodes in the chunk
+ *  @return The new chunk, or NULL if the allocation failed
+ */
+extern poolChunk_t *growCache(unsigned numOfNodes);
+
+/**
+ *  @brief  Starts draining the given chunk out of the pool.
+ *          Segments of the chunk are no longer returned to the free list once freed.
+ *          The actual work is done by drainChunk().
+ *  @param  poolChunk_t *pChunk - the chunk to be drained
+ *  @return None
+ */
+extern void shrinkCache(poolChunk_t *pChunk);
+
+/**
+ *  @brief  Runs one bounded drain step on a chunk marked by shrinkCache().
+ *          Retires free segments of the chunk, evicts clean and unpinned ones,
+ *          and skips dirty, pinned or allocated ones till a later step.
+ *          Once all segments are retired, moves nodes of the chunk still used in the tree
+ *          onto spare nodes, then releases the chunk.
+ *  @param  poolChunk_t *pChunk - the chunk being drained
+ *          unsigned budget - maximum number of segments or nodes to examine
+ *  @return true if the chunk got released. pChunk must not be used afterwards.
+ */
+extern bool drainChunk(poolChunk_t *pChunk, unsigned budget);
+
+/**
+ *  @brief  Initializes the given TAVL tree as empty, with an empty Thread
+ *  @param  tavl_t *pTavl - pointer to the tavl structure
+ *  @return None
+ */
+extern void initTavl(tavl_t *pTavl);
+
 /**
  *  @brief  Initializes the whole cache management structure - cacheMgmt, 
  *  @param  int maxNode - number of nodes